@@ -0,0 +1,277 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * © 2010 Michael Stapelberg
+ *
+ * See LICENSE for licensing information
+ *
+ * atlas.c: stores the rasterized layers of the unlock indicator in a file
+ *          (one per SVG and scaling factor), which every i3lock instance
+ *          using the same SVG maps instead of rendering the layers itself.
+ *
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <cairo.h>
+
+#include "i3lock.h"
+#include "atlas.h"
+#include "cache.h"
+
+extern bool debug_mode;
+
+/* Identifies i3lock layer atlas files. Bump the version whenever the layout
+ * of atlas_header_t or atlas_entry_t changes. */
+#define ATLAS_MAGIC "i3lkatl1"
+
+/* Written in native byte order, so that atlas files from machines with a
+ * different byte order are ignored (the pixels are native-endian, too). */
+#define ATLAS_BYTE_ORDER 0x01020304
+
+/* Alignment of the pixels of each layer within the file. */
+#define ATLAS_ALIGNMENT 64
+
+/* Header of a layer atlas file, followed by one atlas_entry_t per layer. */
+typedef struct atlas_header {
+    char magic[8];
+    uint32_t byte_order;
+    uint32_t layers_count;
+    uint64_t svg_hash;
+    double scale;
+    /* Size of the unlock indicator at this scaling factor. */
+    uint32_t width;
+    uint32_t height;
+} atlas_header_t;
+
+/* Position and size of a layer within the unlock indicator, and where its
+ * pixels (ARGB32, with the given stride) are stored in the file. A width of
+ * 0 means the layer is empty. */
+typedef struct atlas_entry {
+    int32_t x;
+    int32_t y;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    uint32_t reserved;
+    uint64_t offset;
+} atlas_entry_t;
+
+/* The mapping of an atlas file, shared by the surfaces of all its layers and
+ * unmapped together with the last of them. */
+typedef struct atlas_mapping {
+    void *addr;
+    size_t length;
+    int refs;
+} atlas_mapping_t;
+
+static const cairo_user_data_key_t atlas_mapping_key;
+
+/*
+ * Returns the name of the atlas file for the given SVG and scaling factor,
+ * which needs to be freed, or NULL.
+ *
+ */
+static char *atlas_file_name(const char *cache_dir, uint64_t svg_hash, double scale) {
+    char *name;
+    if (asprintf(&name, "%s/%016llx-%ld.layers", cache_dir,
+                 (unsigned long long)svg_hash, lround(scale * 1000)) == -1)
+        return NULL;
+    return name;
+}
+
+static void atlas_header_init(atlas_header_t *header, uint64_t svg_hash, double scale,
+                              int width, int height, int count) {
+    memset(header, 0, sizeof(atlas_header_t));
+    memcpy(header->magic, ATLAS_MAGIC, sizeof(header->magic));
+    header->byte_order = ATLAS_BYTE_ORDER;
+    header->layers_count = count;
+    header->svg_hash = svg_hash;
+    header->scale = scale;
+    header->width = width;
+    header->height = height;
+}
+
+static void unref_atlas_mapping(void *data) {
+    atlas_mapping_t *mapping = data;
+    if (--mapping->refs > 0)
+        return;
+    munmap(mapping->addr, mapping->length);
+    free(mapping);
+}
+
+/*
+ * Returns whether the given atlas entry describes a layer which lies within
+ * the unlock indicator and whose pixels lie within the file.
+ *
+ */
+static bool atlas_entry_valid(const atlas_entry_t *entry, const atlas_header_t *header,
+                              uint64_t data_start, size_t length) {
+    if (entry->width == 0)
+        return true;
+    return (entry->x >= 0 && entry->y >= 0 &&
+            (uint64_t)entry->x + entry->width <= header->width &&
+            (uint64_t)entry->y + entry->height <= header->height &&
+            entry->stride == (uint32_t)cairo_format_stride_for_width(CAIRO_FORMAT_ARGB32, entry->width) &&
+            entry->offset % ATLAS_ALIGNMENT == 0 &&
+            entry->offset >= data_start &&
+            entry->offset + (uint64_t)entry->stride * entry->height <= length);
+}
+
+/*
+ * Maps the atlas file for the given SVG and scaling factor and fills in the
+ * given layers, whose surfaces use the mapped pixels directly. Returns false
+ * if there is no (valid) atlas file, in which case no layer is filled in.
+ *
+ */
+bool load_layer_atlas(const char *cache_dir, uint64_t svg_hash, double scale,
+                      int width, int height, int count, atlas_layer_t *layers) {
+    char *name = atlas_file_name(cache_dir, svg_hash, scale);
+    if (name == NULL)
+        return false;
+
+    int fd = open(name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        free(name);
+        return false;
+    }
+
+    /* Whoever owns the file could truncate it while it is mapped, which
+     * would crash (i.e. unlock) us. Only files written by ourselves or
+     * installed by root (see --indicator-cache-shared) are safe to map. */
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (st.st_uid != getuid() && st.st_uid != 0) ||
+        (size_t)st.st_size < sizeof(atlas_header_t) + count * sizeof(atlas_entry_t)) {
+        DEBUG("ignoring layer atlas %s\n", name);
+        close(fd);
+        free(name);
+        return false;
+    }
+
+    /* The mapping is private, so accidental writes by Cairo never reach the
+     * file. Until then, all instances share the same pages. */
+    size_t length = st.st_size;
+    void *addr = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        free(name);
+        return false;
+    }
+
+    atlas_header_t expected;
+    atlas_header_init(&expected, svg_hash, scale, width, height, count);
+    const atlas_header_t *header = addr;
+    const atlas_entry_t *entries = (const atlas_entry_t *)(header + 1);
+    const uint64_t data_start = sizeof(atlas_header_t) + count * sizeof(atlas_entry_t);
+    bool valid = (memcmp(header, &expected, sizeof(atlas_header_t)) == 0);
+    for (int i = 0; valid && i < count; i++)
+        valid = atlas_entry_valid(&entries[i], header, data_start, length);
+
+    atlas_mapping_t *mapping = (valid ? malloc(sizeof(atlas_mapping_t)) : NULL);
+    if (mapping == NULL) {
+        DEBUG("layer atlas %s is stale, ignoring it\n", name);
+        munmap(addr, length);
+        free(name);
+        return false;
+    }
+    mapping->addr = addr;
+    mapping->length = length;
+    /* Held until all layers are set up. */
+    mapping->refs = 1;
+
+    bool ok = true;
+    for (int i = 0; i < count; i++) {
+        layers[i].surface = NULL;
+        layers[i].x = entries[i].x;
+        layers[i].y = entries[i].y;
+        if (!ok || entries[i].width == 0)
+            continue;
+
+        cairo_surface_t *surface = cairo_image_surface_create_for_data(
+            (unsigned char *)addr + entries[i].offset, CAIRO_FORMAT_ARGB32,
+            entries[i].width, entries[i].height, entries[i].stride);
+        if (cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS ||
+            cairo_surface_set_user_data(surface, &atlas_mapping_key, mapping, unref_atlas_mapping) != CAIRO_STATUS_SUCCESS) {
+            cairo_surface_destroy(surface);
+            ok = false;
+            continue;
+        }
+        mapping->refs++;
+        layers[i].surface = surface;
+    }
+
+    if (!ok) {
+        for (int i = 0; i < count; i++) {
+            if (layers[i].surface != NULL)
+                cairo_surface_destroy(layers[i].surface);
+            layers[i].surface = NULL;
+        }
+    }
+    unref_atlas_mapping(mapping);
+
+    if (ok)
+        DEBUG("mapped %d indicator layers from %s\n", count, name);
+    free(name);
+    return ok;
+}
+
+/*
+ * Stores the given layers in the atlas file for the given SVG and scaling
+ * factor. Like image cache files, the file is written under a temporary name
+ * and then renamed. Errors are not fatal, the layers just get rendered again
+ * next time.
+ *
+ */
+void write_layer_atlas(const char *cache_dir, uint64_t svg_hash, double scale,
+                       int width, int height, int count, const atlas_layer_t *layers) {
+    if (!cache_mkdir(cache_dir))
+        return;
+
+    char *name = atlas_file_name(cache_dir, svg_hash, scale);
+    char *tmp_name;
+    if (name == NULL)
+        return;
+    int fd = cache_open_temp(name, &tmp_name);
+    if (fd == -1) {
+        free(name);
+        return;
+    }
+
+    atlas_entry_t *entries = calloc(count, sizeof(atlas_entry_t));
+    atlas_header_t header;
+    atlas_header_init(&header, svg_hash, scale, width, height, count);
+
+    bool ok = (entries != NULL);
+    uint64_t offset = sizeof(atlas_header_t) + count * sizeof(atlas_entry_t);
+    for (int i = 0; ok && i < count; i++) {
+        entries[i].x = layers[i].x;
+        entries[i].y = layers[i].y;
+        if (layers[i].surface == NULL)
+            continue;
+
+        cairo_surface_t *surface = layers[i].surface;
+        cairo_surface_flush(surface);
+        offset = (offset + ATLAS_ALIGNMENT - 1) / ATLAS_ALIGNMENT * ATLAS_ALIGNMENT;
+        entries[i].width = cairo_image_surface_get_width(surface);
+        entries[i].height = cairo_image_surface_get_height(surface);
+        entries[i].stride = cairo_image_surface_get_stride(surface);
+        entries[i].offset = offset;
+
+        const size_t data_size = (size_t)entries[i].stride * entries[i].height;
+        ok = cache_pwrite(fd, cairo_image_surface_get_data(surface), data_size, offset);
+        offset += data_size;
+    }
+
+    ok = (ok && cache_pwrite(fd, &header, sizeof(header), 0) &&
+          cache_pwrite(fd, entries, count * sizeof(atlas_entry_t), sizeof(header)));
+    cache_commit_temp(fd, tmp_name, name, ok);
+    free(entries);
+    free(name);
+}
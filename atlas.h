@@ -0,0 +1,22 @@
+#ifndef _ATLAS_H
+#define _ATLAS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <cairo.h>
+
+/* A rasterized layer of the unlock indicator and its position within the
+ * unlock indicator. The surface is NULL if the layer is empty. */
+typedef struct atlas_layer {
+    cairo_surface_t *surface;
+    int x;
+    int y;
+} atlas_layer_t;
+
+bool load_layer_atlas(const char *cache_dir, uint64_t svg_hash, double scale,
+                      int width, int height, int count, atlas_layer_t *layers);
+void write_layer_atlas(const char *cache_dir, uint64_t svg_hash, double scale,
+                       int width, int height, int count, const atlas_layer_t *layers);
+
+#endif
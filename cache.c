@@ -0,0 +1,118 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * © 2010 Michael Stapelberg
+ *
+ * See LICENSE for licensing information
+ *
+ * cache.c: helpers for the files kept in cache directories, i.e. decoded
+ *          background images (image.c) and layer atlases (atlas.c).
+ *
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "i3lock.h"
+#include "cache.h"
+
+extern bool debug_mode;
+
+/*
+ * Returns the 64-bit FNV-1a hash of the given data, used to name cache files.
+ * The header of each cache file then tells whether it actually belongs to
+ * the hashed data.
+ *
+ */
+uint64_t cache_hash(const void *data, size_t length) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (const unsigned char *c = data; c < (const unsigned char *)data + length; c++) {
+        hash ^= *c;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/*
+ * Creates the given cache directory (and its parent, e.g. ~/.cache) if
+ * necessary. The cached data might be private, so nobody else gets access.
+ * Returns false if the directory does not exist afterwards.
+ *
+ */
+bool cache_mkdir(const char *cache_dir) {
+    char *parent = strdup(cache_dir);
+    if (parent != NULL) {
+        char *slash = strrchr(parent, '/');
+        if (slash != NULL && slash != parent) {
+            *slash = '\0';
+            mkdir(parent, 0700);
+        }
+        free(parent);
+    }
+    if (mkdir(cache_dir, 0700) == -1 && errno != EEXIST) {
+        DEBUG("could not create cache directory %s: %s\n", cache_dir, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Creates a temporary file next to the cache file with the given name and
+ * returns its file descriptor, or -1. Its name is stored in tmp_name, which
+ * needs to be passed to cache_commit_temp() once the file is written, so
+ * that concurrently starting instances never see a partially written file.
+ *
+ */
+int cache_open_temp(const char *name, char **tmp_name) {
+    if (asprintf(tmp_name, "%s.XXXXXX", name) == -1) {
+        *tmp_name = NULL;
+        return -1;
+    }
+    int fd = mkstemp(*tmp_name);
+    if (fd == -1) {
+        DEBUG("could not create %s: %s\n", *tmp_name, strerror(errno));
+        free(*tmp_name);
+        *tmp_name = NULL;
+    }
+    return fd;
+}
+
+/*
+ * Writes size bytes of data to the given file at offset. Returns false if
+ * that fails.
+ *
+ */
+bool cache_pwrite(int fd, const void *data, size_t size, off_t offset) {
+    for (size_t written = 0; written < size;) {
+        ssize_t n = pwrite(fd, (const char *)data + written, size - written, offset + written);
+        if (n <= 0)
+            return false;
+        written += n;
+    }
+    return true;
+}
+
+/*
+ * Closes the temporary file created by cache_open_temp() and, if it was
+ * written completely (ok), renames it to the given name, otherwise removes
+ * it. Frees tmp_name. Returns whether the cache file was written.
+ *
+ */
+bool cache_commit_temp(int fd, char *tmp_name, const char *name, bool ok) {
+    if (close(fd) == -1)
+        ok = false;
+    if (ok && rename(tmp_name, name) == 0) {
+        DEBUG("wrote cache file %s\n", name);
+    } else {
+        DEBUG("could not write cache file %s\n", name);
+        unlink(tmp_name);
+        ok = false;
+    }
+    free(tmp_name);
+    return ok;
+}
@@ -0,0 +1,15 @@
+#ifndef _CACHE_H
+#define _CACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+uint64_t cache_hash(const void *data, size_t length);
+bool cache_mkdir(const char *cache_dir);
+int cache_open_temp(const char *name, char **tmp_name);
+bool cache_pwrite(int fd, const void *data, size_t size, off_t offset);
+bool cache_commit_temp(int fd, char *tmp_name, const char *name, bool ok);
+
+#endif
@@ -14,8 +14,14 @@
 #include <unistd.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <time.h>
+#include <pthread.h>
 #include <xcb/xcb.h>
+#include <xcb/xcb_aux.h>
 #include <xcb/xkb.h>
+#include <xcb/xinerama.h>
+#include <xcb/randr.h>
+#include <xcb/shm.h>
 #include <err.h>
 #include <assert.h>
 #include <security/pam_appl.h>
@@ -35,8 +41,11 @@
 #include "cursors.h"
 #include "unlock_indicator.h"
 #include "xinerama.h"
+#include "randr.h"
+#include "image.h"
+#include "trace.h"
+#include "screenshot.h"
 
-#include "button.h"
 
 #define TSTAMP_N_SECS(n) (n * 1.0)
 #define TSTAMP_N_MINS(n) (60 * TSTAMP_N_SECS(n))
@@ -56,17 +65,89 @@ static pam_handle_t *pam_handle;
 int input_position = 0;
 /* Holds the password you enter (in UTF-8). */
 static char password[512];
+/* Holds the password while it is verified by the authentication thread, so
+ * that keys pressed in the meantime do not interfere. */
+static char auth_password[512];
 static bool beep = false;
 bool debug_mode = false;
+/* Maximum number of redraws per second, 0 for no limit. */
+int redraw_rate = 60;
 bool unlock_indicator = true;
 char *modifier_string = NULL;
 static bool dont_fork = false;
+/* Whether to fork a separate process which keeps the window raised (see
+ * raise_loop()). The main loop does this itself unless it is blocked. */
+static bool raise_process = false;
 struct ev_loop *main_loop;
 static struct ev_timer *clear_pam_wrong_timeout;
 static struct ev_timer *clear_indicator_timeout;
 static struct ev_timer *discard_passwd_timeout;
+/* Redraws the unlock indicator without the keypress highlight. Re-armed on
+ * every keypress (and never freed), so a burst of keys only causes one
+ * trailing redraw. */
+static struct ev_timer *indicator_decay_timeout;
+/* Signalled by the authentication thread once PAM returned. */
+static struct ev_async *auth_done_watcher;
+static pthread_t auth_thread;
+/* The return value of pam_authenticate(), set by the authentication thread. */
+static int auth_result;
+
+/* Signals that the background image (-i) was decoded by image_thread. */
+static struct ev_async *image_loaded_watcher;
+static pthread_t image_thread;
+static cairo_surface_t *loaded_img;
+
+/* Directory to cache decoded background images in, NULL to disable. */
+static char *image_cache_dir = NULL;
+
+/* Directory to share rasterized indicator layers between instances in, NULL
+ * to disable. */
+char *indicator_cache_dir = NULL;
+
+/* Directory with rasterized indicator layers installed by the administrator
+ * for all users, NULL to disable. */
+char *indicator_shared_cache_dir = NULL;
+
+/* What image_thread works on once it is started (see start_image_thread()):
+ * the path of the background image (-i), or the screenshot to filter. */
+static char *pending_image_path = NULL;
+static cairo_surface_t *pending_screenshot = NULL;
+
+/* How long decoding the background image took in image_thread, in ms. */
+static double image_decode_ms;
+
+/* Use a blurred (--blur) and/or pixelated (--pixelate) screenshot as the
+ * background image, 0 to disable either. */
+static int blur_radius = 0;
+static int pixelate_size = 0;
+
+/* The Xinerama screens at the time the screenshot was taken. The screenshot
+ * is filtered in the background, so xr_resolutions cannot be used. */
+static Rect *screenshot_screens = NULL;
+static int screenshot_screens_count = 0;
+
+/* Phases of the startup and when each one ended, see startup_phase(). */
+#define MAX_STARTUP_PHASES 20
+static struct startup_phase {
+    const char *name;
+    struct timespec end;
+} startup_phases[MAX_STARTUP_PHASES];
+static int startup_phases_count = 0;
+static struct timespec startup_begin;
+
+/* Whether to exit (and report the startup phases) once the keyboard is
+ * grabbed, see --benchmark-startup. */
+static bool benchmark_startup = false;
+
+/* Number of cycles through all unlock indicator states to time before
+ * exiting, see --benchmark-redraw. 0 to lock normally. */
+static int benchmark_redraws = 0;
 extern unlock_state_t unlock_state;
 extern pam_state_t pam_state;
+extern int current_frame;
+
+/* Bytes uploaded via MIT-SHM so far, defined in xcb.c. */
+extern unsigned long long shm_bytes_uploaded;
 
 static struct xkb_state *xkb_state;
 static struct xkb_context *xkb_context;
@@ -75,6 +156,43 @@ static struct xkb_compose_table *xkb_compose_table;
 static struct xkb_compose_state *xkb_compose_state;
 static uint8_t xkb_base_event;
 static uint8_t xkb_base_error;
+static xkb_mod_index_t ctrl_mod_index = XKB_MOD_INVALID;
+
+/* Reloads the keymap shortly after the last XKB keymap change notification,
+ * since tools like setxkbmap send a burst of them. */
+static struct ev_timer *keymap_reload_timeout;
+#define KEYMAP_RELOAD_DELAY TSTAMP_N_SECS(0.1)
+
+/* A key translated with the current keymap, see lookup_key(). */
+typedef struct key_lookup {
+    bool valid;
+    /* The modifier and layout state the key was translated with. */
+    xkb_mod_mask_t mods;
+    xkb_layout_index_t layout;
+    xkb_keysym_t ksym;
+    /* The result of xkb_keysym_to_utf8(), i.e. n includes the terminating
+     * null byte. */
+    char utf8[8];
+    int n;
+} key_lookup_t;
+
+/* Translated keys, indexed by keycode. This holds the characters of typed
+ * passwords, so it is locked in memory like the password. */
+static key_lookup_t key_cache[256];
+
+/* The modifier and layout state of xkb_state, see update_effective_state(). */
+static xkb_mod_mask_t effective_mods;
+static xkb_layout_index_t effective_layout;
+
+/* Human-readable names of the modifiers of the current keymap, indexed by
+ * xkb_mod_index_t. NULL for unnamed modifiers. */
+#define MAX_MODS (sizeof(xkb_mod_mask_t) * 8)
+static const char *mod_names[MAX_MODS];
+
+/* The modifiers modifier_names was built for, see get_modifier_string(). */
+static bool modifier_names_valid = false;
+static xkb_mod_mask_t modifier_names_mask;
+static char modifier_names[256];
 
 cairo_surface_t *img = NULL;
 RsvgHandle *svg = NULL;
@@ -82,6 +200,7 @@ int anim_layer_count = 0;
 bool remove_background = false;
 bool sequential_animation = false;
 bool tile = false;
+image_mode_t image_mode = IMAGE_MODE_NONE;
 bool ignore_empty_password = false;
 bool skip_repeated_empty_password = false;
 
@@ -96,6 +215,70 @@ void u8_dec(char *s, int *i) {
     (void)(isutf(s[--(*i)]) || isutf(s[--(*i)]) || isutf(s[--(*i)]) || --(*i));
 }
 
+/*
+ * Remembers the modifier and layout state of xkb_state, which decides
+ * whether cached key translations (see lookup_key()) and the modifier string
+ * (see get_modifier_string()) can be re-used. Needs to be called whenever
+ * xkb_state changes.
+ *
+ */
+static void update_effective_state(void) {
+    effective_mods = xkb_state_serialize_mods(xkb_state, XKB_STATE_MODS_EFFECTIVE);
+    effective_layout = xkb_state_serialize_layout(xkb_state, XKB_STATE_LAYOUT_EFFECTIVE);
+}
+
+/*
+ * Looks up the names of the modifiers of the current keymap, replacing
+ * certain xkb names with nicer, human-readable ones.
+ *
+ */
+static void load_mod_names(void) {
+    xkb_mod_index_t num_mods = xkb_keymap_num_mods(xkb_keymap);
+
+    for (xkb_mod_index_t idx = 0; idx < MAX_MODS; idx++) {
+        const char *mod_name = (idx < num_mods ? xkb_keymap_mod_get_name(xkb_keymap, idx) : NULL);
+        mod_names[idx] = mod_name;
+        if (mod_name == NULL)
+            continue;
+
+        if (strcmp(mod_name, XKB_MOD_NAME_CAPS) == 0)
+            mod_names[idx] = "Caps Lock";
+        else if (strcmp(mod_name, XKB_MOD_NAME_ALT) == 0)
+            mod_names[idx] = "Alt";
+        else if (strcmp(mod_name, XKB_MOD_NAME_NUM) == 0)
+            mod_names[idx] = "Num Lock";
+        else if (strcmp(mod_name, XKB_MOD_NAME_LOGO) == 0)
+            mod_names[idx] = "Win";
+    }
+    modifier_names_valid = false;
+}
+
+/*
+ * Returns the list of active modifiers (e.g. "Caps Lock, Num Lock"), or NULL
+ * if none are active. The list is only built again if the modifiers changed
+ * since the last call.
+ *
+ */
+static char *get_modifier_string(void) {
+    if (!modifier_names_valid || modifier_names_mask != effective_mods) {
+        size_t len = 0;
+        modifier_names[0] = '\0';
+        for (xkb_mod_index_t idx = 0; idx < MAX_MODS; idx++) {
+            if (!(effective_mods & (1U << idx)) || mod_names[idx] == NULL)
+                continue;
+            int written = snprintf(modifier_names + len, sizeof(modifier_names) - len,
+                                   "%s%s", (len > 0 ? ", " : ""), mod_names[idx]);
+            if (written < 0 || (size_t)written >= sizeof(modifier_names) - len)
+                break;
+            len += written;
+        }
+        modifier_names_mask = effective_mods;
+        modifier_names_valid = true;
+    }
+
+    return (modifier_names[0] != '\0' ? modifier_names : NULL);
+}
+
 /*
  * Loads the XKB keymap from the X11 server and feeds it to xkbcommon.
  * Necessary so that we can properly let xkbcommon track the keyboard state and
@@ -129,9 +312,33 @@ static bool load_keymap(void) {
     xkb_state_unref(xkb_state);
     xkb_state = new_state;
 
+    ctrl_mod_index = xkb_keymap_mod_get_index(xkb_keymap, XKB_MOD_NAME_CTRL);
+    memset(key_cache, 0, sizeof(key_cache));
+    update_effective_state();
+    load_mod_names();
+
     return true;
 }
 
+/*
+ * Translates the given key with the current keyboard state, re-using the
+ * previous translation if the modifiers and layout did not change since.
+ *
+ */
+static const key_lookup_t *lookup_key(xcb_keycode_t keycode) {
+    key_lookup_t *key = &key_cache[keycode];
+    if (key->valid && key->mods == effective_mods && key->layout == effective_layout)
+        return key;
+
+    key->ksym = xkb_state_key_get_one_sym(xkb_state, keycode);
+    memset(key->utf8, '\0', sizeof(key->utf8));
+    key->n = xkb_keysym_to_utf8(key->ksym, key->utf8, sizeof(key->utf8));
+    key->mods = effective_mods;
+    key->layout = effective_layout;
+    key->valid = true;
+    return key;
+}
+
 /*
  * Loads the XKB compose table from the given locale.
  *
@@ -161,11 +368,11 @@ static bool load_compose_table(const char *locale) {
  * cold-boot attacks.
  *
  */
-static void clear_password_memory(void) {
+static void clear_password_memory(char *buffer, size_t size) {
     /* A volatile pointer to the password buffer to prevent the compiler from
      * optimizing this out. */
-    volatile char *vpassword = password;
-    for (int c = 0; c < sizeof(password); c++)
+    volatile char *vpassword = buffer;
+    for (int c = 0; c < size; c++)
         /* We store a non-random pattern which consists of the (irrelevant)
          * index plus (!) the value of the beep variable. This prevents the
          * compiler from optimizing the calls away, since the value of 'beep'
@@ -198,6 +405,34 @@ ev_timer *stop_timer(ev_timer *timer_obj) {
     return NULL;
 }
 
+static void keymap_reload_cb(EV_P_ ev_timer *w, int revents) {
+    STOP_TIMER(keymap_reload_timeout);
+    (void)load_keymap();
+}
+
+/*
+ * Reloads the keymap after the next burst of keymap changes is over. If the
+ * timer cannot be started, the keymap is reloaded right away.
+ *
+ */
+static void schedule_keymap_reload(void) {
+    START_TIMER(keymap_reload_timeout, KEYMAP_RELOAD_DELAY, keymap_reload_cb);
+    if (keymap_reload_timeout == NULL)
+        (void)load_keymap();
+}
+
+/*
+ * Does a scheduled keymap reload right away, so that a key press is not
+ * translated with an outdated keymap.
+ *
+ */
+static void flush_keymap_reload(void) {
+    if (keymap_reload_timeout == NULL)
+        return;
+    STOP_TIMER(keymap_reload_timeout);
+    (void)load_keymap();
+}
+
 /*
  * Resets pam_state to STATE_PAM_IDLE 2 seconds after an unsuccessful
  * authentication event.
@@ -206,13 +441,10 @@ ev_timer *stop_timer(ev_timer *timer_obj) {
 static void clear_pam_wrong(EV_P_ ev_timer *w, int revents) {
     DEBUG("clearing pam wrong\n");
     pam_state = STATE_PAM_IDLE;
-    redraw_screen();
+    queue_redraw();
 
     /* Clear modifier string. */
-    if (modifier_string != NULL) {
-        free(modifier_string);
-        modifier_string = NULL;
-    }
+    modifier_string = NULL;
 
     /* Now free this timeout. */
     STOP_TIMER(clear_pam_wrong_timeout);
@@ -225,8 +457,10 @@ static void clear_indicator_cb(EV_P_ ev_timer *w, int revents) {
 
 static void clear_input(void) {
     input_position = 0;
-    clear_password_memory();
+    clear_password_memory(password, sizeof(password));
     password[input_position] = '\0';
+    /* The cached translations hold the typed characters, too. */
+    memset(key_cache, 0, sizeof(key_cache));
 }
 
 static void discard_passwd_cb(EV_P_ ev_timer *w, int revents) {
@@ -234,15 +468,25 @@ static void discard_passwd_cb(EV_P_ ev_timer *w, int revents) {
     STOP_TIMER(discard_passwd_timeout);
 }
 
-static void input_done(void) {
-    STOP_TIMER(clear_pam_wrong_timeout);
-    pam_state = STATE_PAM_VERIFY;
-    unlock_state = STATE_STARTED;
-    redraw_screen();
+/*
+ * Runs pam_authenticate() in a separate thread, so that the event loop keeps
+ * handling X11 events (and redrawing) while PAM is busy, for example when
+ * waiting for a slow LDAP or Kerberos server. auth_done_cb is invoked on the
+ * main loop once PAM returns.
+ *
+ */
+static void *authenticate(void *arg) {
+    auth_result = pam_authenticate(pam_handle, 0);
+    ev_async_send(main_loop, auth_done_watcher);
+    return NULL;
+}
+
+static void handle_auth_result(void) {
+    clear_password_memory(auth_password, sizeof(auth_password));
 
-    if (pam_authenticate(pam_handle, 0) == PAM_SUCCESS) {
+    if (auth_result == PAM_SUCCESS) {
         DEBUG("successfully authenticated\n");
-        clear_password_memory();
+        clear_password_memory(password, sizeof(password));
 
         /* PAM credentials should be refreshed, this will for example update any kerberos tickets.
          * Related to credentials pam_end() needs to be called to cleanup any temporary
@@ -259,43 +503,13 @@ static void input_done(void) {
 
     /* Get state of Caps and Num lock modifiers, to be displayed in
      * STATE_PAM_WRONG state */
-    xkb_mod_index_t idx, num_mods;
-    const char *mod_name;
-
-    num_mods = xkb_keymap_num_mods(xkb_keymap);
-
-    for (idx = 0; idx < num_mods; idx++) {
-        if (!xkb_state_mod_index_is_active(xkb_state, idx, XKB_STATE_MODS_EFFECTIVE))
-            continue;
-
-        mod_name = xkb_keymap_mod_get_name(xkb_keymap, idx);
-        if (mod_name == NULL)
-            continue;
-
-        /* Replace certain xkb names with nicer, human-readable ones. */
-        if (strcmp(mod_name, XKB_MOD_NAME_CAPS) == 0)
-            mod_name = "Caps Lock";
-        else if (strcmp(mod_name, XKB_MOD_NAME_ALT) == 0)
-            mod_name = "Alt";
-        else if (strcmp(mod_name, XKB_MOD_NAME_NUM) == 0)
-            mod_name = "Num Lock";
-        else if (strcmp(mod_name, XKB_MOD_NAME_LOGO) == 0)
-            mod_name = "Win";
-
-        char *tmp;
-        if (modifier_string == NULL) {
-            if (asprintf(&tmp, "%s", mod_name) != -1)
-                modifier_string = tmp;
-        } else if (asprintf(&tmp, "%s, %s", modifier_string, mod_name) != -1) {
-            free(modifier_string);
-            modifier_string = tmp;
-        }
-    }
+    modifier_string = get_modifier_string();
 
+    /* The input buffer was already cleared when the password was handed over
+     * to the authentication thread, keys pressed since then are kept. */
     pam_state = STATE_PAM_WRONG;
-    clear_input();
     if (unlock_indicator)
-        redraw_screen();
+        queue_redraw();
 
     /* Clear this state after 2 seconds (unless the user enters another
      * password during that time). */
@@ -306,16 +520,269 @@ static void input_done(void) {
      * too early. */
     STOP_TIMER(clear_indicator_timeout);
 
-    /* beep on authentication failure, if enabled */
-    if (beep) {
+    /* beep on authentication failure, if enabled (the request is flushed
+     * before the event loop blocks again) */
+    if (beep)
         xcb_bell(conn, 100);
+}
+
+static void auth_done_cb(EV_P_ ev_async *w, int revents) {
+    pthread_join(auth_thread, NULL);
+    handle_auth_result();
+}
+
+/*
+ * Returns the time from a to b in milliseconds.
+ *
+ */
+static double elapsed_ms(const struct timespec *a, const struct timespec *b) {
+    return (b->tv_sec - a->tv_sec) * 1000.0 + (b->tv_nsec - a->tv_nsec) / 1000000.0;
+}
+
+/*
+ * Marks the end of the given startup phase (which began at the end of the
+ * previous one). The duration is logged in debug mode and reported by
+ * --benchmark-startup.
+ *
+ */
+static void startup_phase(const char *name) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    const struct timespec *begin = (startup_phases_count > 0 ? &startup_phases[startup_phases_count - 1].end : &startup_begin);
+    DEBUG("startup: %s took %.3f ms (%.3f ms since start)\n",
+          name, elapsed_ms(begin, &now), elapsed_ms(&startup_begin, &now));
+
+    if (startup_phases_count == MAX_STARTUP_PHASES)
+        return;
+    startup_phases[startup_phases_count].name = name;
+    startup_phases[startup_phases_count].end = now;
+    startup_phases_count++;
+}
+
+/*
+ * Prints the duration of all startup phases to stdout.
+ *
+ */
+static void print_startup_phases(void) {
+    printf("%-28s %10s %10s\n", "phase", "ms", "total ms");
+    const struct timespec *begin = &startup_begin;
+    for (int i = 0; i < startup_phases_count; i++) {
+        printf("%-28s %10.3f %10.3f\n", startup_phases[i].name,
+               elapsed_ms(begin, &startup_phases[i].end),
+               elapsed_ms(&startup_begin, &startup_phases[i].end));
+        begin = &startup_phases[i].end;
+    }
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    const double da = *(const double *)a, db = *(const double *)b;
+    return (da > db) - (da < db);
+}
+
+/*
+ * Returns how many bytes this process has written so far, or -1 if this is
+ * unknown (/proc/self/io is Linux-specific). While benchmarking, this is
+ * mostly what was written to the X11 socket. Images uploaded via MIT-SHM do
+ * not go through the socket, see shm_bytes_uploaded.
+ *
+ */
+static long long bytes_written(void) {
+    FILE *f = fopen("/proc/self/io", "r");
+    if (f == NULL)
+        return -1;
+
+    char line[128];
+    long long wchar = -1;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "wchar: %lld", &wchar) == 1)
+            break;
+    }
+    fclose(f);
+    return wchar;
+}
+
+/*
+ * Redraws the screen in every state of the unlock indicator (each animation
+ * frame, backspace, verifying, wrong password, hidden), the given number of
+ * times, and prints the latency of the redraws to stdout. Each redraw is
+ * timed until the X server processed it.
+ *
+ */
+static void run_redraw_benchmark(int cycles) {
+    const int steps = anim_layer_count + 5;
+    const int count = cycles * steps;
+    double *latencies = calloc(count, sizeof(double));
+    if (latencies == NULL)
+        errx(EXIT_FAILURE, "Could not allocate memory for the benchmark\n");
+
+    const long long bytes_before = bytes_written();
+    const unsigned long long shm_before = shm_bytes_uploaded;
+    int n = 0;
+    for (int cycle = 0; cycle < cycles; cycle++) {
+        for (int step = 0; step < steps; step++) {
+            pam_state = STATE_PAM_IDLE;
+            if (step < anim_layer_count) {
+                unlock_state = STATE_KEY_ACTIVE;
+                current_frame = step;
+            } else if (step == anim_layer_count) {
+                unlock_state = STATE_KEY_PRESSED;
+            } else if (step == anim_layer_count + 1) {
+                unlock_state = STATE_BACKSPACE_ACTIVE;
+            } else if (step == anim_layer_count + 2) {
+                unlock_state = STATE_STARTED;
+                pam_state = STATE_PAM_VERIFY;
+            } else if (step == anim_layer_count + 3) {
+                unlock_state = STATE_STARTED;
+                pam_state = STATE_PAM_WRONG;
+            } else {
+                unlock_state = STATE_STARTED;
+            }
+
+            struct timespec begin, end;
+            clock_gettime(CLOCK_MONOTONIC, &begin);
+            redraw_screen();
+            free(xcb_get_input_focus_reply(conn, xcb_get_input_focus(conn), NULL));
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            latencies[n++] = elapsed_ms(&begin, &end);
+        }
+    }
+    const long long bytes_after = bytes_written();
+
+    qsort(latencies, n, sizeof(double), compare_doubles);
+    printf("%d redraws (%d cycles of %d states) at %d x %d, %d screen(s)\n",
+           n, cycles, steps, last_resolution[0], last_resolution[1], (xr_screens > 0 ? xr_screens : 1));
+    printf("p50 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+           latencies[n / 2], latencies[(n * 99) / 100], latencies[n - 1]);
+    if (bytes_before >= 0 && bytes_after >= 0)
+        printf("%lld bytes written to the X11 socket (%.0f per redraw)\n",
+               bytes_after - bytes_before, (double)(bytes_after - bytes_before) / n);
+    const unsigned long long shm_bytes = shm_bytes_uploaded - shm_before;
+    printf("%llu bytes uploaded via MIT-SHM (%.0f per redraw)\n",
+           shm_bytes, (double)shm_bytes / n);
+    free(latencies);
+}
+
+/*
+ * Decodes the background image in a separate thread, so that the screen can
+ * already be locked (showing the background color) while a large image is
+ * still being decoded. image_loaded_cb is invoked on the main loop once the
+ * image is ready.
+ *
+ */
+static void *load_image_thread(void *arg) {
+    struct timespec begin, end;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    loaded_img = load_image(arg, image_cache_dir);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    image_decode_ms = elapsed_ms(&begin, &end);
+    ev_async_send(main_loop, image_loaded_watcher);
+    return NULL;
+}
+
+/*
+ * Filters the screenshot in the background, like load_image_thread() decodes
+ * the image, since the lock window does not need to wait for this.
+ *
+ */
+static void *filter_screenshot_thread(void *arg) {
+    struct timespec begin, end;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    filter_screenshot(arg, screenshot_screens, screenshot_screens_count, pixelate_size, blur_radius);
+    loaded_img = arg;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    image_decode_ms = elapsed_ms(&begin, &end);
+    ev_async_send(main_loop, image_loaded_watcher);
+    return NULL;
+}
+
+/*
+ * Switches the background to loaded_img, the result of image_thread.
+ *
+ */
+static void show_loaded_image(void) {
+    /* In case loading failed, we just pretend no -i was specified. */
+    if (loaded_img == NULL)
+        return;
+
+    DEBUG("background image loaded\n");
+    img = loaded_img;
+    /* The background needs to be rendered again, now with the image. */
+    free_bg_pixmap();
+    queue_redraw();
+}
+
+static void image_loaded_cb(EV_P_ ev_async *w, int revents) {
+    pthread_join(image_thread, NULL);
+    ev_async_stop(main_loop, image_loaded_watcher);
+    show_loaded_image();
+}
+
+/*
+ * Starts image_thread, which decodes the background image or filters the
+ * screenshot, if there is one pending. Threads do not survive the fork()
+ * after the lock window is mapped (see xcb_check_cb()), so unless we do not
+ * fork, this is done in the child, which keeps running.
+ *
+ */
+static void start_image_thread(void) {
+    if (pending_image_path == NULL && pending_screenshot == NULL)
+        return;
+
+    image_loaded_watcher = calloc(sizeof(struct ev_async), 1);
+    ev_async_init(image_loaded_watcher, image_loaded_cb);
+    ev_async_start(main_loop, image_loaded_watcher);
+
+    bool started;
+    if (pending_image_path != NULL)
+        started = (pthread_create(&image_thread, NULL, load_image_thread, pending_image_path) == 0);
+    else
+        started = (pthread_create(&image_thread, NULL, filter_screenshot_thread, pending_screenshot) == 0);
+
+    if (!started) {
+        /* We cannot load the image in the background, so block instead. */
+        perror("pthread_create");
+        ev_async_stop(main_loop, image_loaded_watcher);
+        if (pending_image_path != NULL) {
+            loaded_img = load_image(pending_image_path, image_cache_dir);
+        } else {
+            filter_screenshot(pending_screenshot, screenshot_screens, screenshot_screens_count, pixelate_size, blur_radius);
+            loaded_img = pending_screenshot;
+        }
+        show_loaded_image();
+    }
+    pending_image_path = NULL;
+    pending_screenshot = NULL;
+}
+
+static void input_done(void) {
+    STOP_TIMER(clear_pam_wrong_timeout);
+    pam_state = STATE_PAM_VERIFY;
+    unlock_state = STATE_STARTED;
+    queue_redraw();
+
+    memcpy(auth_password, password, sizeof(password));
+    clear_input();
+
+    if (pthread_create(&auth_thread, NULL, authenticate, NULL) != 0) {
+        /* We cannot authenticate in the background, so block instead. */
+        perror("pthread_create");
+        redraw_screen();
         xcb_flush(conn);
+        auth_result = pam_authenticate(pam_handle, 0);
+        handle_auth_result();
     }
 }
 
+/*
+ * Removes the keypress highlight from the unlock indicator.
+ *
+ */
 static void redraw_timeout(EV_P_ ev_timer *w, int revents) {
-    redraw_screen();
-    STOP_TIMER(w);
+    if (unlock_state == STATE_KEY_ACTIVE ||
+        unlock_state == STATE_BACKSPACE_ACTIVE)
+        unlock_state = STATE_KEY_PRESSED;
+    queue_redraw();
 }
 
 static bool skip_without_validation(void) {
@@ -341,8 +808,10 @@ static void handle_key_press(xcb_key_press_event_t *event) {
     bool ctrl;
     bool composed = false;
 
-    ksym = xkb_state_key_get_one_sym(xkb_state, event->detail);
-    ctrl = xkb_state_mod_name_is_active(xkb_state, XKB_MOD_NAME_CTRL, XKB_STATE_MODS_DEPRESSED);
+    flush_keymap_reload();
+    const key_lookup_t *key = lookup_key(event->detail);
+    ksym = key->ksym;
+    ctrl = (xkb_state_mod_index_is_active(xkb_state, ctrl_mod_index, XKB_STATE_MODS_DEPRESSED) > 0);
 
     /* The buffer will be null-terminated, so n >= 2 for 1 actual character. */
     memset(buffer, '\0', sizeof(buffer));
@@ -367,8 +836,10 @@ static void handle_key_press(xcb_key_press_event_t *event) {
     }
 
     if (!composed) {
-        n = xkb_keysym_to_utf8(ksym, buffer, sizeof(buffer));
+        memcpy(buffer, key->utf8, sizeof(key->utf8));
+        n = key->n;
     }
+    trace_key_lookup_done();
 
     switch (ksym) {
         case XKB_KEY_j:
@@ -378,7 +849,7 @@ static void handle_key_press(xcb_key_press_event_t *event) {
             if (ksym == XKB_KEY_j && !ctrl)
                 break;
 
-            if (pam_state == STATE_PAM_WRONG)
+            if (pam_state == STATE_PAM_VERIFY || pam_state == STATE_PAM_WRONG)
                 return;
 
             if (skip_without_validation()) {
@@ -387,7 +858,6 @@ static void handle_key_press(xcb_key_press_event_t *event) {
             }
             password[input_position] = '\0';
             unlock_state = STATE_KEY_PRESSED;
-            redraw_screen();
             input_done();
             skip_repeated_empty_password = true;
             return;
@@ -407,8 +877,8 @@ static void handle_key_press(xcb_key_press_event_t *event) {
                 if (unlock_indicator) {
                     START_TIMER(clear_indicator_timeout, 1.0, clear_indicator_cb);
                     unlock_state = STATE_BACKSPACE_ACTIVE;
-                    redraw_screen();
-                    unlock_state = STATE_KEY_PRESSED;
+                    select_animation_frame();
+                    queue_redraw();
                 }
                 return;
             }
@@ -438,8 +908,8 @@ static void handle_key_press(xcb_key_press_event_t *event) {
              * empty. */
             START_TIMER(clear_indicator_timeout, 1.0, clear_indicator_cb);
             unlock_state = STATE_BACKSPACE_ACTIVE;
-            redraw_screen();
-            unlock_state = STATE_KEY_PRESSED;
+            select_animation_frame();
+            queue_redraw();
             return;
     }
 
@@ -466,12 +936,12 @@ static void handle_key_press(xcb_key_press_event_t *event) {
     DEBUG("current password = %.*s\n", input_position, password);
 
     if (unlock_indicator) {
+        /* The highlight is removed again by redraw_timeout. */
         unlock_state = STATE_KEY_ACTIVE;
-        redraw_screen();
-        unlock_state = STATE_KEY_PRESSED;
+        select_animation_frame();
+        queue_redraw();
 
-        struct ev_timer *timeout = NULL;
-        START_TIMER(timeout, TSTAMP_N_SECS(0.25), redraw_timeout);
+        START_TIMER(indicator_decay_timeout, TSTAMP_N_SECS(0.25), redraw_timeout);
         STOP_TIMER(clear_indicator_timeout);
     }
 
@@ -492,7 +962,6 @@ static void handle_visibility_notify(xcb_connection_t *conn,
     if (event->state != XCB_VISIBILITY_UNOBSCURED) {
         uint32_t values[] = {XCB_STACK_MODE_ABOVE};
         xcb_configure_window(conn, event->window, XCB_CONFIG_WINDOW_STACK_MODE, values);
-        xcb_flush(conn);
     }
 }
 
@@ -525,16 +994,17 @@ static void process_xkb_event(xcb_generic_event_t *gevent) {
     /*
      * XkbNewKkdNotify and XkbMapNotify together capture all sorts of keymap
      * updates (e.g. xmodmap, xkbcomp, setxkbmap), with minimal redundent
-     * recompilations.
+     * recompilations. Since these come in bursts, the keymap is only
+     * recompiled once the burst is over.
      */
     switch (event->any.xkbType) {
         case XCB_XKB_NEW_KEYBOARD_NOTIFY:
             if (event->new_keyboard_notify.changed & XCB_XKB_NKN_DETAIL_KEYCODES)
-                (void)load_keymap();
+                schedule_keymap_reload();
             break;
 
         case XCB_XKB_MAP_NOTIFY:
-            (void)load_keymap();
+            schedule_keymap_reload();
             break;
 
         case XCB_XKB_STATE_NOTIFY:
@@ -545,14 +1015,16 @@ static void process_xkb_event(xcb_generic_event_t *gevent) {
                                   event->state_notify.baseGroup,
                                   event->state_notify.latchedGroup,
                                   event->state_notify.lockedGroup);
+            update_effective_state();
             break;
     }
 }
 
 /*
- * Called when the properties on the root window change, e.g. when the screen
- * resolution changes. If so we update the window to cover the whole screen
- * and also redraw the image, if any.
+ * Called when the properties on the root window change or RandR reports a
+ * change, e.g. when the screen resolution changes or a monitor is connected.
+ * If so we update the window to cover the whole screen and also redraw the
+ * image, if any. Nothing is redrawn if nothing actually changed.
  *
  */
 void handle_screen_resize(void) {
@@ -562,25 +1034,36 @@ void handle_screen_resize(void) {
     if ((geom = xcb_get_geometry_reply(conn, geomc, 0)) == NULL)
         return;
 
-    if (last_resolution[0] == geom->width &&
-        last_resolution[1] == geom->height) {
-        free(geom);
-        return;
-    }
-
-    last_resolution[0] = geom->width;
-    last_resolution[1] = geom->height;
+    bool resized = (last_resolution[0] != geom->width ||
+                    last_resolution[1] != geom->height);
+    if (resized) {
+        last_resolution[0] = geom->width;
+        last_resolution[1] = geom->height;
 
+        uint32_t mask = XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT;
+        xcb_configure_window(conn, win, mask, last_resolution);
+    }
     free(geom);
 
-    redraw_screen();
+    /* Monitors can be re-arranged without the root window changing its
+     * size, so the screens are checked in any case. */
+    bool screens_changed = xinerama_query_screens();
+    bool outputs_changed = randr_query_outputs();
+    if (!resized && !screens_changed && !outputs_changed)
+        return;
 
-    uint32_t mask = XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT;
-    xcb_configure_window(conn, win, mask, last_resolution);
-    xcb_flush(conn);
+    DEBUG("screen configuration changed (resized = %d, screens = %d, outputs = %d)\n",
+          resized, screens_changed, outputs_changed);
 
-    xinerama_query_screens();
-    redraw_screen();
+    /* The background has to be rendered again for the new resolution, or if
+     * the image is placed on each screen. */
+    if (resized || (screens_changed && image_mode != IMAGE_MODE_NONE))
+        free_bg_pixmap();
+
+    /* The unlock indicator is placed anew. Renders at scaling factors which
+     * are still in use are kept. */
+    invalidate_render_context();
+    queue_redraw();
 }
 
 /*
@@ -605,7 +1088,7 @@ static int conv_callback(int num_msg, const struct pam_message **msg,
 
         /* return code is currently not used but should be set to zero */
         resp[c]->resp_retcode = 0;
-        if ((resp[c]->resp = strdup(password)) == NULL) {
+        if ((resp[c]->resp = strdup(auth_password)) == NULL) {
             perror("strdup");
             return 1;
         }
@@ -624,11 +1107,25 @@ static void xcb_got_event(EV_P_ struct ev_io *w, int revents) {
 }
 
 /*
- * Flush before blocking (and waiting for new events)
+ * Redraw (if requested and due) and flush before blocking (and waiting for
+ * new events)
  *
  */
 static void xcb_prepare_cb(EV_P_ ev_prepare *w, int revents) {
+    process_queued_redraw();
     xcb_flush(conn);
+    trace_flushed();
+}
+
+/*
+ * Parses the indicator SVG once the screen is locked and there is nothing
+ * else to do, so that it neither delays locking nor the first key press.
+ *
+ */
+static void svg_idle_cb(EV_P_ ev_idle *w, int revents) {
+    ev_idle_stop(main_loop, w);
+    free(w);
+    parse_indicator_svg();
 }
 
 /*
@@ -651,9 +1148,15 @@ static void maybe_close_sleep_lock_fd(void) {
  * Instead of polling the X connection socket we leave this to
  * xcb_poll_for_event() which knows better than we can ever know.
  *
+ * All queued events are handled as one batch: the handlers only update the
+ * state and queue a redraw, the screen is then redrawn (and the connection
+ * flushed) only once, in xcb_prepare_cb. Screen changes are handled once per
+ * batch, too, since xrandr usually causes several ConfigureNotify events.
+ *
  */
 static void xcb_check_cb(EV_P_ ev_check *w, int revents) {
     xcb_generic_event_t *event;
+    bool resize_pending = false;
 
     if (xcb_connection_has_error(conn))
         errx(EXIT_FAILURE, "X11 connection broke, did your server terminate?\n");
@@ -673,9 +1176,17 @@ static void xcb_check_cb(EV_P_ ev_check *w, int revents) {
 
         switch (type) {
             case XCB_KEY_PRESS:
+                trace_key_begin(((xcb_key_press_event_t *)event)->time);
+                note_user_input();
                 handle_key_press((xcb_key_press_event_t *)event);
                 break;
 
+            case XCB_MOTION_NOTIFY:
+            case XCB_BUTTON_PRESS:
+                /* Only selected while the monitors are off. */
+                note_user_input();
+                break;
+
             case XCB_VISIBILITY_NOTIFY:
                 handle_visibility_notify(conn, (xcb_visibility_notify_event_t *)event);
                 break;
@@ -692,26 +1203,35 @@ static void xcb_check_cb(EV_P_ ev_check *w, int revents) {
                         exit(0);
 
                     ev_loop_fork(EV_DEFAULT);
+                    start_image_thread();
                 }
                 break;
 
             case XCB_CONFIGURE_NOTIFY:
-                handle_screen_resize();
+                /* Our own window is reconfigured whenever it is raised. */
+                if (((xcb_configure_notify_event_t *)event)->window == screen->root)
+                    resize_pending = true;
                 break;
 
             default:
                 if (type == xkb_base_event)
                     process_xkb_event(event);
+                else if (randr_is_change_event(type))
+                    resize_pending = true;
         }
 
         free(event);
     }
+
+    if (resize_pending)
+        handle_screen_resize();
 }
 
 /*
  * This function is called from a fork()ed child and will raise the i3lock
  * window when the window is obscured, even when the main i3lock process is
- * blocked due to PAM.
+ * blocked. Since PAM runs in its own thread, the main loop handles this by
+ * itself, so the child is only forked with --raise-process.
  *
  */
 static void raise_loop(xcb_window_t window) {
@@ -745,6 +1265,9 @@ static void raise_loop(xcb_window_t window) {
         switch (type) {
             case XCB_VISIBILITY_NOTIFY:
                 handle_visibility_notify(conn, (xcb_visibility_notify_event_t *)event);
+                /* There is no event loop flushing this connection, and
+                 * xcb_wait_for_event() does not flush either. */
+                xcb_flush(conn);
                 break;
             case XCB_UNMAP_NOTIFY:
                 DEBUG("UnmapNotify for 0x%08x\n", (((xcb_unmap_notify_event_t *)event)->window));
@@ -764,6 +1287,23 @@ static void raise_loop(xcb_window_t window) {
     }
 }
 
+/*
+ * Returns the default cache directory, $XDG_CACHE_HOME/i3lock, which needs to
+ * be freed, or NULL.
+ *
+ */
+static char *default_cache_dir(const struct passwd *pw) {
+    char *dir;
+    const char *cache_home = getenv("XDG_CACHE_HOME");
+    if (cache_home != NULL && cache_home[0] == '/') {
+        if (asprintf(&dir, "%s/i3lock", cache_home) == -1)
+            return NULL;
+    } else if (asprintf(&dir, "%s/.cache/i3lock", pw->pw_dir) == -1) {
+        return NULL;
+    }
+    return dir;
+}
+
 int main(int argc, char *argv[]) {
     struct passwd *pw;
     char *username;
@@ -774,6 +1314,7 @@ int main(int argc, char *argv[]) {
     int curs_choice = CURS_NONE;
     int o;
     int optind = 0;
+    clock_gettime(CLOCK_MONOTONIC, &startup_begin);
     struct option longopts[] = {
         {"version", no_argument, NULL, 'v'},
         {"nofork", no_argument, NULL, 'n'},
@@ -782,6 +1323,17 @@ int main(int argc, char *argv[]) {
         {"color", required_argument, NULL, 'c'},
         {"pointer", required_argument, NULL, 'p'},
         {"debug", no_argument, NULL, 0},
+        {"redraw-rate", required_argument, NULL, 0},
+        {"image-cache", optional_argument, NULL, 0},
+        {"indicator-cache", optional_argument, NULL, 0},
+        {"indicator-cache-shared", required_argument, NULL, 0},
+        {"image-mode", required_argument, NULL, 0},
+        {"blur", optional_argument, NULL, 0},
+        {"pixelate", optional_argument, NULL, 0},
+        {"benchmark-startup", no_argument, NULL, 0},
+        {"benchmark-redraw", required_argument, NULL, 0},
+        {"trace-keys", required_argument, NULL, 0},
+        {"raise-process", no_argument, NULL, 0},
         {"help", no_argument, NULL, 'h'},
         {"no-unlock-indicator", no_argument, NULL, 'u'},
         {"image", required_argument, NULL, 'i'},
@@ -858,6 +1410,49 @@ int main(int argc, char *argv[]) {
             case 0:
                 if (strcmp(longopts[optind].name, "debug") == 0)
                     debug_mode = true;
+                else if (strcmp(longopts[optind].name, "redraw-rate") == 0) {
+                    int rate = 0;
+                    if (sscanf(optarg, "%d", &rate) != 1 || rate < 0)
+                        errx(EXIT_FAILURE, "invalid redraw rate, it must be a positive integer\n");
+                    redraw_rate = rate;
+                } else if (strcmp(longopts[optind].name, "raise-process") == 0) {
+                    raise_process = true;
+                } else if (strcmp(longopts[optind].name, "trace-keys") == 0) {
+                    trace_init(strdup(optarg));
+                } else if (strcmp(longopts[optind].name, "benchmark-redraw") == 0) {
+                    if (sscanf(optarg, "%d", &benchmark_redraws) != 1 || benchmark_redraws < 1)
+                        errx(EXIT_FAILURE, "invalid number of benchmark cycles, it must be a positive integer\n");
+                } else if (strcmp(longopts[optind].name, "benchmark-startup") == 0) {
+                    benchmark_startup = true;
+                } else if (strcmp(longopts[optind].name, "image-mode") == 0) {
+                    if (strcmp(optarg, "center") == 0)
+                        image_mode = IMAGE_MODE_CENTER;
+                    else if (strcmp(optarg, "fill") == 0)
+                        image_mode = IMAGE_MODE_FILL;
+                    else if (strcmp(optarg, "fit") == 0)
+                        image_mode = IMAGE_MODE_FIT;
+                    else if (strcmp(optarg, "stretch") == 0)
+                        image_mode = IMAGE_MODE_STRETCH;
+                    else
+                        errx(EXIT_FAILURE, "i3lock: Invalid image mode given. Expected one of \"center\", \"fill\", \"fit\" or \"stretch\".\n");
+                } else if (strcmp(longopts[optind].name, "blur") == 0) {
+                    blur_radius = 10;
+                    if (optarg != NULL && (sscanf(optarg, "%d", &blur_radius) != 1 || blur_radius < 1))
+                        errx(EXIT_FAILURE, "invalid blur radius, it must be a positive integer\n");
+                } else if (strcmp(longopts[optind].name, "pixelate") == 0) {
+                    pixelate_size = 16;
+                    if (optarg != NULL && (sscanf(optarg, "%d", &pixelate_size) != 1 || pixelate_size < 2))
+                        errx(EXIT_FAILURE, "invalid pixel size, it must be an integer greater than 1\n");
+                } else if (strcmp(longopts[optind].name, "image-cache") == 0) {
+                    free(image_cache_dir);
+                    image_cache_dir = (optarg != NULL ? strdup(optarg) : default_cache_dir(pw));
+                } else if (strcmp(longopts[optind].name, "indicator-cache") == 0) {
+                    free(indicator_cache_dir);
+                    indicator_cache_dir = (optarg != NULL ? strdup(optarg) : default_cache_dir(pw));
+                } else if (strcmp(longopts[optind].name, "indicator-cache-shared") == 0) {
+                    free(indicator_shared_cache_dir);
+                    indicator_shared_cache_dir = strdup(optarg);
+                }
                 break;
 /*            case 'f':
                 show_failed_attempts = true;
@@ -878,6 +1473,7 @@ int main(int argc, char *argv[]) {
 
     if ((ret = pam_set_item(pam_handle, PAM_TTY, getenv("DISPLAY"))) != PAM_SUCCESS)
         errx(EXIT_FAILURE, "PAM: %s", pam_strerror(pam_handle, ret));
+    startup_phase("pam_start");
 
 /* Using mlock() as non-super-user seems only possible in Linux. Users of other
  * operating systems should use encrypted swap/no swap (or remove the ifdef and
@@ -886,7 +1482,9 @@ int main(int argc, char *argv[]) {
     /* Lock the area where we store the password in memory, we don’t want it to
      * be swapped to disk. Since Linux 2.6.9, this does not require any
      * privileges, just enough bytes in the RLIMIT_MEMLOCK limit. */
-    if (mlock(password, sizeof(password)) != 0)
+    if (mlock(password, sizeof(password)) != 0 ||
+        mlock(auth_password, sizeof(auth_password)) != 0 ||
+        mlock(key_cache, sizeof(key_cache)) != 0)
         err(EXIT_FAILURE, "Could not lock page in memory, check RLIMIT_MEMLOCK");
 #endif
 
@@ -895,6 +1493,15 @@ int main(int argc, char *argv[]) {
     if ((conn = xcb_connect(NULL, &screennr)) == NULL ||
         xcb_connection_has_error(conn))
         errx(EXIT_FAILURE, "Could not connect to X11, maybe you need to set DISPLAY?");
+    startup_phase("xcb_connect");
+
+    /* Query all extensions we use at once, instead of one round trip for
+     * each of them when they are first used. */
+    xcb_prefetch_extension_data(conn, &xcb_xkb_id);
+    xcb_prefetch_extension_data(conn, &xcb_xinerama_id);
+    xcb_prefetch_extension_data(conn, &xcb_randr_id);
+    xcb_prefetch_extension_data(conn, &xcb_shm_id);
+    xcb_prefetch_extension_data(conn, &xcb_dpms_id);
 
     if (xkb_x11_setup_xkb_extension(conn,
                                     XKB_X11_MIN_MAJOR_XKB_VERSION,
@@ -933,6 +1540,7 @@ int main(int argc, char *argv[]) {
     /* When we cannot initially load the keymap, we better exit */
     if (!load_keymap())
         errx(EXIT_FAILURE, "Could not load keymap");
+    startup_phase("xkb setup and keymap");
 
     const char *locale = getenv("LC_ALL");
     if (!locale)
@@ -946,66 +1554,84 @@ int main(int argc, char *argv[]) {
     }
 
     load_compose_table(locale);
+    startup_phase("compose table");
 
     xinerama_init();
-    xinerama_query_screens();
+    startup_phase("xinerama");
 
     screen = xcb_setup_roots_iterator(xcb_get_setup(conn)).data;
 
     last_resolution[0] = screen->width_in_pixels;
     last_resolution[1] = screen->height_in_pixels;
 
+    randr_init();
+    startup_phase("randr");
+
     xcb_change_window_attributes(conn, screen->root, XCB_CW_EVENT_MASK,
                                  (uint32_t[]){XCB_EVENT_MASK_STRUCTURE_NOTIFY});
 
-    if (image_path) {
-        /* Create a pixmap to render on, fill it with the background color */
-        img = cairo_image_surface_create_from_png(image_path);
-        /* In case loading failed, we just pretend no -i was specified. */
-        if (cairo_surface_status(img) != CAIRO_STATUS_SUCCESS) {
-            fprintf(stderr, "Could not load image \"%s\": %s\n",
-                    image_path, cairo_status_to_string(cairo_surface_status(img)));
-            img = NULL;
-        }
-    }
-
-    /* Load SVG */
-    GError* e = NULL;
-    if (svg_path == NULL) {
-        svg = rsvg_handle_new_from_data(button_svg, sizeof(button_svg), &e);
-    } else {
-       svg = rsvg_handle_new_from_file(svg_path, &e);
-    }
+    /* Initialize the libev event loop. This is done early so that the
+     * background image can already be decoded in the background. */
+    main_loop = EV_DEFAULT;
+    if (main_loop == NULL)
+        errx(EXIT_FAILURE, "Could not initialize libev. Bad LIBEV_FLAGS?\n");
 
-    if(e != NULL) {
-        errx(EXIT_FAILURE, "Could not load indicator SVG: %s", e->message);
-    }
+    if (image_path && (blur_radius > 0 || pixelate_size > 0))
+        errx(EXIT_FAILURE, "i3lock: --blur and --pixelate use a screenshot, they cannot be combined with -i.\n");
 
-    for(;anim_layer_count < 100; anim_layer_count++) {
-        char anim_id[9];
-        snprintf(anim_id, sizeof(anim_id), "#anim%02d", anim_layer_count);
+    if (image_path) {
+        /* The window is opened with the background color and the image is
+         * swapped in once it has been decoded. */
+        pending_image_path = image_path;
+    } else if (blur_radius > 0 || pixelate_size > 0) {
+        /* The screenshot needs to be taken before the lock window is
+         * mapped, it is filtered in the background afterwards. */
+        cairo_surface_t *shot = take_screenshot(last_resolution);
+        if (shot != NULL) {
+            /* The screenshot spans the whole root window. */
+            image_mode = IMAGE_MODE_NONE;
+            tile = false;
+
+            if (xr_screens > 0 && (screenshot_screens = calloc(xr_screens, sizeof(Rect))) != NULL) {
+                memcpy(screenshot_screens, xr_resolutions, xr_screens * sizeof(Rect));
+                screenshot_screens_count = xr_screens;
+            }
 
-        if(rsvg_handle_has_sub(svg, anim_id) != TRUE) {
-            break;
+            pending_screenshot = shot;
         }
     }
-
-    if(rsvg_handle_has_sub(svg, "#remove_background") == TRUE) {
-        remove_background = true;
-    }
-
-    if(rsvg_handle_has_sub(svg, "#sequential_animation") == TRUE) {
-        sequential_animation = true;
-    }
+    /* Benchmark runs exit before they would fork. */
+    if (dont_fork || benchmark_startup || benchmark_redraws > 0)
+        start_image_thread();
+    startup_phase("image loader");
+
+    /* Load SVG. The built-in one is pre-rasterized, so it is only parsed
+     * when it needs to be rendered at an uncommon scaling factor. Other SVGs
+     * are parsed once the screen is locked, see svg_idle_cb(). */
+    if (svg_path == NULL)
+        load_builtin_indicator();
+    else
+        load_indicator_svg(svg_path);
+    startup_phase("svg id scan");
 
     /* Pixmap on which the image is rendered to (if any) */
     xcb_pixmap_t bg_pixmap = draw_image(last_resolution);
+    startup_phase("draw_image");
 
     /* open the fullscreen window, already with the correct pixmap in place */
     win = open_fullscreen_window(conn, screen, color, bg_pixmap);
-    xcb_free_pixmap(conn, bg_pixmap);
-
-    pid_t pid = fork();
+    startup_phase("open_fullscreen_window");
+
+    /* The main loop raises the window whenever it gets obscured, a separate
+     * process (with its own X11 connection) is only needed if the main loop
+     * might block, e.g. when a PAM module misbehaves. Benchmark runs exit
+     * right after grabbing, no need to keep the window raised. */
+    const bool fork_raise_process = (raise_process && !benchmark_startup && benchmark_redraws == 0);
+    /* The child changes the attributes of the window on its own connection,
+     * so the X server needs to have created the window by then. */
+    if (fork_raise_process)
+        xcb_aux_sync(conn);
+    pid_t pid = (fork_raise_process ? fork() : -1);
     /* The pid == -1 case is intentionally ignored here:
      * While the child process is useful for preventing other windows from
      * popping up while i3lock blocks, it is not critical. */
@@ -1018,19 +1644,33 @@ int main(int argc, char *argv[]) {
     }
 
     cursor = create_cursor(conn, screen, win, curs_choice);
+    startup_phase("create_cursor");
 
     grab_pointer_and_keyboard(conn, screen, cursor);
+    startup_phase("grab");
+
+    if (benchmark_startup) {
+        print_startup_phases();
+        /* The image is decoded concurrently, so report it separately. */
+        if (image_loaded_watcher != NULL && ev_is_active(image_loaded_watcher)) {
+            pthread_join(image_thread, NULL);
+            printf("%-28s %10.3f\n", "image decode (in background)", image_decode_ms);
+        }
+        if (benchmark_redraws == 0)
+            exit(EXIT_SUCCESS);
+    }
+
+    if (benchmark_redraws > 0) {
+        run_redraw_benchmark(benchmark_redraws);
+        exit(EXIT_SUCCESS);
+    }
+
     /* Load the keymap again to sync the current modifier state. Since we first
      * loaded the keymap, there might have been changes, but starting from now,
      * we should get all key presses/releases due to having grabbed the
      * keyboard. */
     (void)load_keymap();
 
-    /* Initialize the libev event loop. */
-    main_loop = EV_DEFAULT;
-    if (main_loop == NULL)
-        errx(EXIT_FAILURE, "Could not initialize libev. Bad LIBEV_FLAGS?\n");
-
     struct ev_io *xcb_watcher = calloc(sizeof(struct ev_io), 1);
     struct ev_check *xcb_check = calloc(sizeof(struct ev_check), 1);
     struct ev_prepare *xcb_prepare = calloc(sizeof(struct ev_prepare), 1);
@@ -1044,6 +1684,14 @@ int main(int argc, char *argv[]) {
     ev_prepare_init(xcb_prepare, xcb_prepare_cb);
     ev_prepare_start(main_loop, xcb_prepare);
 
+    auth_done_watcher = calloc(sizeof(struct ev_async), 1);
+    ev_async_init(auth_done_watcher, auth_done_cb);
+    ev_async_start(main_loop, auth_done_watcher);
+
+    struct ev_idle *svg_idle = calloc(sizeof(struct ev_idle), 1);
+    ev_idle_init(svg_idle, svg_idle_cb);
+    ev_idle_start(main_loop, svg_idle);
+
     /* Invoke the event callback once to catch all the events which were
      * received up until now. ev will only pick up new events (when the X11
      * file descriptor becomes readable). */
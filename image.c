@@ -0,0 +1,282 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * © 2010 Michael Stapelberg
+ *
+ * See LICENSE for licensing information
+ *
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <cairo.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+
+#include "i3lock.h"
+#include "image.h"
+#include "cache.h"
+
+extern bool debug_mode;
+
+/* Identifies i3lock image cache files. Bump the version whenever the layout
+ * of cache_header_t changes. */
+#define CACHE_MAGIC "i3lkimg1"
+
+/* Written in native byte order, so that cache files from machines with a
+ * different byte order are ignored (the pixels are native-endian, too). */
+#define CACHE_BYTE_ORDER 0x01020304
+
+/* Header of an image cache file. The pixel data (in the Cairo format, with
+ * the given stride) follows at data_offset, so that it can be used straight
+ * from the mapping. The cached image is only valid if the source image still
+ * has the same device, inode, size and modification time. */
+typedef struct cache_header {
+    char magic[8];
+    uint32_t byte_order;
+    uint32_t format;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    uint32_t data_offset;
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+} cache_header_t;
+
+/* Used to tie the lifetime of the mapping to the Cairo surface. */
+typedef struct cache_mapping {
+    void *addr;
+    size_t length;
+} cache_mapping_t;
+
+static const cairo_user_data_key_t cache_mapping_key;
+
+/*
+ * Returns the name of the cache file for the given image path, which needs to
+ * be freed, or NULL. The path is hashed (FNV-1a), the cache header then tells
+ * whether the cache file actually belongs to this image.
+ *
+ */
+static char *cache_file_name(const char *cache_dir, const char *path) {
+    char *name;
+    if (asprintf(&name, "%s/%016llx.argb", cache_dir,
+                 (unsigned long long)cache_hash(path, strlen(path))) == -1)
+        return NULL;
+    return name;
+}
+
+static void cache_header_init(cache_header_t *header, const struct stat *st) {
+    memset(header, 0, sizeof(cache_header_t));
+    memcpy(header->magic, CACHE_MAGIC, sizeof(header->magic));
+    header->byte_order = CACHE_BYTE_ORDER;
+    header->dev = st->st_dev;
+    header->ino = st->st_ino;
+    header->size = st->st_size;
+    header->mtime_sec = st->st_mtim.tv_sec;
+    header->mtime_nsec = st->st_mtim.tv_nsec;
+}
+
+static void unmap_cache_file(void *data) {
+    cache_mapping_t *mapping = data;
+    munmap(mapping->addr, mapping->length);
+    free(mapping);
+}
+
+/*
+ * Maps the cache file for the image with the given stat data and returns a
+ * Cairo surface using the mapped pixels directly. Returns NULL if there is no
+ * (valid) cache file.
+ *
+ */
+static cairo_surface_t *load_cache_file(const char *name, const struct stat *st) {
+    int fd = open(name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return NULL;
+
+    /* Whoever owns the cache file could truncate it while it is mapped,
+     * which would crash (i.e. unlock) us. Only files written by ourselves or
+     * by root are safe to map. */
+    struct stat cache_st;
+    if (fstat(fd, &cache_st) == -1 || (cache_st.st_uid != getuid() && cache_st.st_uid != 0) ||
+        (size_t)cache_st.st_size < sizeof(cache_header_t)) {
+        close(fd);
+        return NULL;
+    }
+
+    /* The mapping is private, so accidental writes by Cairo never reach the
+     * cache file. */
+    size_t length = cache_st.st_size;
+    void *addr = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED)
+        return NULL;
+
+    cache_header_t expected;
+    cache_header_init(&expected, st);
+    const cache_header_t *header = addr;
+    if (memcmp(header->magic, expected.magic, sizeof(header->magic)) != 0 ||
+        header->byte_order != expected.byte_order ||
+        header->dev != expected.dev || header->ino != expected.ino ||
+        header->size != expected.size ||
+        header->mtime_sec != expected.mtime_sec ||
+        header->mtime_nsec != expected.mtime_nsec ||
+        (header->format != CAIRO_FORMAT_ARGB32 && header->format != CAIRO_FORMAT_RGB24) ||
+        header->stride != (uint32_t)cairo_format_stride_for_width(header->format, header->width) ||
+        header->data_offset < sizeof(cache_header_t) ||
+        header->data_offset + (uint64_t)header->stride * header->height > length) {
+        DEBUG("image cache file %s is stale, ignoring it\n", name);
+        munmap(addr, length);
+        return NULL;
+    }
+
+    cache_mapping_t *mapping = malloc(sizeof(cache_mapping_t));
+    if (mapping == NULL) {
+        munmap(addr, length);
+        return NULL;
+    }
+    mapping->addr = addr;
+    mapping->length = length;
+
+    cairo_surface_t *img = cairo_image_surface_create_for_data(
+        (unsigned char *)addr + header->data_offset, header->format,
+        header->width, header->height, header->stride);
+    if (cairo_surface_status(img) != CAIRO_STATUS_SUCCESS ||
+        cairo_surface_set_user_data(img, &cache_mapping_key, mapping, unmap_cache_file) != CAIRO_STATUS_SUCCESS) {
+        cairo_surface_destroy(img);
+        unmap_cache_file(mapping);
+        return NULL;
+    }
+
+    DEBUG("loaded image from cache file %s\n", name);
+    return img;
+}
+
+/*
+ * Stores the decoded image in the cache directory. The cache file is written
+ * under a temporary name and then renamed, so that concurrently starting
+ * instances never see a partially written file. Errors are not fatal, the
+ * image just gets decoded again next time.
+ *
+ */
+static void write_cache_file(const char *cache_dir, const char *name,
+                             const struct stat *st, cairo_surface_t *img) {
+    char *tmp_name;
+    if (!cache_mkdir(cache_dir))
+        return;
+    int fd = cache_open_temp(name, &tmp_name);
+    if (fd == -1)
+        return;
+
+    cache_header_t header;
+    cache_header_init(&header, st);
+    header.format = cairo_image_surface_get_format(img);
+    header.width = cairo_image_surface_get_width(img);
+    header.height = cairo_image_surface_get_height(img);
+    header.stride = cairo_image_surface_get_stride(img);
+    /* Page-align the pixels, in case they are used for MIT-SHM or mapped
+     * by something else later. */
+    header.data_offset = 4096;
+
+    cairo_surface_flush(img);
+    const unsigned char *data = cairo_image_surface_get_data(img);
+    const size_t data_size = (size_t)header.stride * header.height;
+    bool ok = (cache_pwrite(fd, &header, sizeof(header), 0) &&
+               cache_pwrite(fd, data, data_size, header.data_offset));
+    cache_commit_temp(fd, tmp_name, name, ok);
+}
+
+/*
+ * Decodes the given image file into a new Cairo image surface. The file can be
+ * in any format supported by gdk-pixbuf (PNG, JPEG and, with the respective
+ * loader installed, WebP and others). Returns NULL if the image could not be
+ * decoded.
+ *
+ */
+static cairo_surface_t *decode_image(const char *path) {
+    GError *err = NULL;
+    GdkPixbuf *pixbuf = gdk_pixbuf_new_from_file(path, &err);
+    if (pixbuf == NULL) {
+        fprintf(stderr, "Could not load image \"%s\": %s\n", path, err->message);
+        g_error_free(err);
+        return NULL;
+    }
+
+    const int width = gdk_pixbuf_get_width(pixbuf);
+    const int height = gdk_pixbuf_get_height(pixbuf);
+    const int channels = gdk_pixbuf_get_n_channels(pixbuf);
+    const int pixbuf_stride = gdk_pixbuf_get_rowstride(pixbuf);
+    const bool has_alpha = gdk_pixbuf_get_has_alpha(pixbuf);
+    const guchar *pixels = gdk_pixbuf_get_pixels(pixbuf);
+
+    cairo_surface_t *img = cairo_image_surface_create(
+        (has_alpha ? CAIRO_FORMAT_ARGB32 : CAIRO_FORMAT_RGB24), width, height);
+    if (cairo_surface_status(img) != CAIRO_STATUS_SUCCESS) {
+        fprintf(stderr, "Could not load image \"%s\": %s\n",
+                path, cairo_status_to_string(cairo_surface_status(img)));
+        cairo_surface_destroy(img);
+        g_object_unref(pixbuf);
+        return NULL;
+    }
+
+    /* gdk-pixbuf stores non-premultiplied RGB(A) bytes, Cairo wants
+     * premultiplied native-endian 32-bit pixels. */
+    cairo_surface_flush(img);
+    unsigned char *data = cairo_image_surface_get_data(img);
+    const int stride = cairo_image_surface_get_stride(img);
+    for (int y = 0; y < height; y++) {
+        const guchar *src = pixels + y * pixbuf_stride;
+        uint32_t *dst = (uint32_t *)(data + y * stride);
+        for (int x = 0; x < width; x++, src += channels) {
+            uint32_t r = src[0], g = src[1], b = src[2];
+            uint32_t a = (has_alpha ? src[3] : 0xff);
+            if (a != 0xff) {
+                r = (r * a + 127) / 255;
+                g = (g * a + 127) / 255;
+                b = (b * a + 127) / 255;
+            }
+            dst[x] = (a << 24) | (r << 16) | (g << 8) | b;
+        }
+    }
+    cairo_surface_mark_dirty(img);
+
+    g_object_unref(pixbuf);
+    return img;
+}
+
+/*
+ * Loads the given image file into a Cairo image surface. If cache_dir is not
+ * NULL, the decoded (premultiplied) pixels are kept in a file in that
+ * directory, so that the next time the image is used it only needs to be
+ * mapped instead of decoded. Returns NULL if the image could not be loaded.
+ *
+ * This does not use X11, so it can be called from any thread.
+ *
+ */
+cairo_surface_t *load_image(const char *path, const char *cache_dir) {
+    struct stat st;
+    char *name = NULL;
+    if (cache_dir != NULL && stat(path, &st) == 0 &&
+        (name = cache_file_name(cache_dir, path)) != NULL) {
+        cairo_surface_t *img = load_cache_file(name, &st);
+        if (img != NULL) {
+            free(name);
+            return img;
+        }
+    }
+
+    cairo_surface_t *img = decode_image(path);
+    if (img != NULL && name != NULL)
+        write_cache_file(cache_dir, name, &st, img);
+
+    free(name);
+    return img;
+}
@@ -0,0 +1,8 @@
+#ifndef _IMAGE_H
+#define _IMAGE_H
+
+#include <cairo.h>
+
+cairo_surface_t *load_image(const char *path, const char *cache_dir);
+
+#endif
@@ -0,0 +1,234 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * © 2010 Michael Stapelberg
+ *
+ * See LICENSE for licensing information
+ *
+ */
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <xcb/xcb.h>
+#include <xcb/randr.h>
+
+#include "i3lock.h"
+#include "xcb.h"
+#include "xinerama.h"
+#include "randr.h"
+
+/* An enabled RandR output and the DPI of the connected monitor. */
+typedef struct Output {
+    Rect rect;
+    int dpi;
+} Output;
+
+/* Number of enabled RandR outputs which are currently present. */
+static int randr_outputs = 0;
+
+/* The enabled RandR outputs. */
+static Output *randr_output_list;
+
+static bool randr_active;
+
+/* The first event number of the RandR extension. */
+static uint8_t randr_base_event;
+extern bool debug_mode;
+
+/*
+ * Queries the geometry and physical size of all enabled RandR outputs from
+ * the given screen resources, so that the DPI of each monitor is known. The
+ * output and CRTC information is requested all at once, so that this only
+ * takes a single round trip regardless of the number of outputs. Returns
+ * whether any output changed.
+ *
+ */
+static bool handle_screen_resources(xcb_randr_get_screen_resources_current_cookie_t rcookie) {
+    xcb_randr_get_screen_resources_current_reply_t *res;
+
+    if ((res = xcb_randr_get_screen_resources_current_reply(conn, rcookie, NULL)) == NULL) {
+        if (debug_mode)
+            fprintf(stderr, "Couldn't get RandR screen resources\n");
+        return false;
+    }
+
+    xcb_randr_output_t *outputs = xcb_randr_get_screen_resources_current_outputs(res);
+    int count = xcb_randr_get_screen_resources_current_outputs_length(res);
+    xcb_randr_crtc_t *crtcs = xcb_randr_get_screen_resources_current_crtcs(res);
+    int crtcs_count = xcb_randr_get_screen_resources_current_crtcs_length(res);
+
+    xcb_randr_get_output_info_cookie_t *ocookies = calloc(count, sizeof(xcb_randr_get_output_info_cookie_t));
+    xcb_randr_get_crtc_info_cookie_t *ccookies = calloc(crtcs_count, sizeof(xcb_randr_get_crtc_info_cookie_t));
+    xcb_randr_get_crtc_info_reply_t **creplies = calloc(crtcs_count, sizeof(xcb_randr_get_crtc_info_reply_t *));
+    Output *list = calloc(count, sizeof(Output));
+    /* No memory? Just keep on using the old information. */
+    if ((count > 0 && (!ocookies || !list)) || (crtcs_count > 0 && (!ccookies || !creplies))) {
+        free(ocookies);
+        free(ccookies);
+        free(creplies);
+        free(list);
+        free(res);
+        return false;
+    }
+
+    for (int i = 0; i < count; i++)
+        ocookies[i] = xcb_randr_get_output_info(conn, outputs[i], res->config_timestamp);
+    for (int i = 0; i < crtcs_count; i++)
+        ccookies[i] = xcb_randr_get_crtc_info(conn, crtcs[i], res->config_timestamp);
+    for (int i = 0; i < crtcs_count; i++)
+        creplies[i] = xcb_randr_get_crtc_info_reply(conn, ccookies[i], NULL);
+
+    int found = 0;
+    for (int i = 0; i < count; i++) {
+        xcb_randr_get_output_info_reply_t *output = xcb_randr_get_output_info_reply(conn, ocookies[i], NULL);
+        if (output == NULL)
+            continue;
+
+        xcb_randr_get_crtc_info_reply_t *crtc = NULL;
+        for (int c = 0; c < crtcs_count && output->crtc != XCB_NONE; c++) {
+            if (crtcs[c] == output->crtc) {
+                crtc = creplies[c];
+                break;
+            }
+        }
+        if (crtc == NULL || crtc->width == 0 || crtc->height == 0) {
+            free(output);
+            continue;
+        }
+
+        /* The physical size is reported for the unrotated monitor. */
+        uint32_t mm_height = output->mm_height;
+        if (crtc->rotation & (XCB_RANDR_ROTATION_ROTATE_90 | XCB_RANDR_ROTATION_ROTATE_270))
+            mm_height = output->mm_width;
+
+        list[found].rect.x = crtc->x;
+        list[found].rect.y = crtc->y;
+        list[found].rect.width = crtc->width;
+        list[found].rect.height = crtc->height;
+        /* Projectors and some broken EDIDs report no physical size. */
+        list[found].dpi = (mm_height > 0 ? (double)crtc->height * 25.4 / (double)mm_height : 0);
+        DEBUG("found RandR output: %d x %d at %d x %d, %d dpi\n",
+              crtc->width, crtc->height, crtc->x, crtc->y, list[found].dpi);
+        found++;
+
+        free(output);
+    }
+
+    for (int i = 0; i < crtcs_count; i++)
+        free(creplies[i]);
+    free(ocookies);
+    free(ccookies);
+    free(creplies);
+    free(res);
+
+    bool changed = (found != randr_outputs ||
+                    (found > 0 && memcmp(list, randr_output_list, found * sizeof(Output)) != 0));
+    if (!changed) {
+        free(list);
+        return false;
+    }
+
+    free(randr_output_list);
+    randr_output_list = list;
+    randr_outputs = found;
+    return true;
+}
+
+/*
+ * Checks for RandR 1.3 and queries the outputs. The screen resources are
+ * requested together with the version, so that this only takes two round
+ * trips.
+ *
+ */
+void randr_init(void) {
+    if (!xcb_get_extension_data(conn, &xcb_randr_id)->present) {
+        DEBUG("RandR extension not found, disabling.\n");
+        return;
+    }
+
+    xcb_randr_query_version_cookie_t cookie;
+    xcb_randr_query_version_reply_t *reply;
+    xcb_randr_get_screen_resources_current_cookie_t rcookie;
+
+    /* We need RandR 1.3 for RRGetScreenResourcesCurrent. Requests are
+     * processed in order, so the version is negotiated before the X server
+     * looks at the second request. */
+    cookie = xcb_randr_query_version(conn, 1, 3);
+    rcookie = xcb_randr_get_screen_resources_current(conn, screen->root);
+    reply = xcb_randr_query_version_reply(conn, cookie, NULL);
+    if (!reply) {
+        xcb_discard_reply(conn, rcookie.sequence);
+        return;
+    }
+
+    if (reply->major_version < 1 ||
+        (reply->major_version == 1 && reply->minor_version < 3)) {
+        DEBUG("RandR %d.%d is too old, disabling.\n",
+              reply->major_version, reply->minor_version);
+        free(reply);
+        xcb_discard_reply(conn, rcookie.sequence);
+        return;
+    }
+
+    randr_active = true;
+    free(reply);
+
+    /* Get notified about monitors being (dis)connected or re-arranged. */
+    randr_base_event = xcb_get_extension_data(conn, &xcb_randr_id)->first_event;
+    xcb_randr_select_input(conn, screen->root,
+                           XCB_RANDR_NOTIFY_MASK_SCREEN_CHANGE |
+                               XCB_RANDR_NOTIFY_MASK_CRTC_CHANGE |
+                               XCB_RANDR_NOTIFY_MASK_OUTPUT_CHANGE);
+
+    handle_screen_resources(rcookie);
+}
+
+/*
+ * Queries the outputs again, e.g. after the screen configuration changed.
+ * Returns whether any output changed.
+ *
+ */
+bool randr_query_outputs(void) {
+    if (!randr_active)
+        return false;
+
+    return handle_screen_resources(xcb_randr_get_screen_resources_current(conn, screen->root));
+}
+
+/*
+ * Returns whether the given event type (with the highest bit stripped off)
+ * is a RandR notification about a change of the screen configuration.
+ *
+ */
+bool randr_is_change_event(int type) {
+    return (randr_active &&
+            (type == randr_base_event + XCB_RANDR_SCREEN_CHANGE_NOTIFY ||
+             type == randr_base_event + XCB_RANDR_NOTIFY));
+}
+
+/*
+ * Returns the DPI of the monitor showing the given screen area, or 0 if it is
+ * unknown. Xinerama screens usually match a RandR output exactly, otherwise
+ * the output containing the center of the area is used.
+ *
+ */
+int randr_get_dpi(const Rect *rect) {
+    int center_x = rect->x + rect->width / 2;
+    int center_y = rect->y + rect->height / 2;
+    int dpi = 0;
+
+    for (int i = 0; i < randr_outputs; i++) {
+        const Rect *output = &randr_output_list[i].rect;
+        if (output->x == rect->x && output->y == rect->y &&
+            output->width == rect->width && output->height == rect->height)
+            return randr_output_list[i].dpi;
+
+        if (dpi == 0 &&
+            center_x >= output->x && center_x < output->x + output->width &&
+            center_y >= output->y && center_y < output->y + output->height)
+            dpi = randr_output_list[i].dpi;
+    }
+
+    return dpi;
+}
@@ -0,0 +1,11 @@
+#ifndef _RANDR_H
+#define _RANDR_H
+
+#include "xinerama.h"
+
+void randr_init(void);
+bool randr_query_outputs(void);
+bool randr_is_change_event(int type);
+int randr_get_dpi(const Rect *rect);
+
+#endif
@@ -0,0 +1,377 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * © 2010 Michael Stapelberg
+ *
+ * See LICENSE for licensing information
+ *
+ * screenshot.c: takes a screenshot of the root window and blurs or pixelates
+ *               it in memory, for using it as the background image.
+ *
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <xcb/xcb.h>
+#include <cairo.h>
+
+#include "i3lock.h"
+#include "xcb.h"
+#include "xinerama.h"
+#include "screenshot.h"
+
+extern bool debug_mode;
+
+/* Upper bound for the number of threads filtering a screenshot. */
+#define MAX_FILTER_THREADS 4
+
+/* The screens of the screenshot, which are filtered by the threads of
+ * filter_screenshot(). */
+static struct filter_work {
+    cairo_surface_t *shot;
+    Rect *screens;
+    int screens_count;
+    int pixelate_size;
+    int blur_radius;
+    /* The next screen which no thread picked up yet. */
+    int next;
+    pthread_mutex_t lock;
+} work = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+/*
+ * Returns whether the root window uses 32 bits per pixel in the byte order of
+ * this machine, i.e. whether its contents can be used as a cairo RGB24
+ * surface as-is.
+ *
+ */
+static bool root_format_supported(void) {
+    const xcb_setup_t *setup = xcb_get_setup(conn);
+    const uint32_t one = 1;
+    uint8_t byte_order = (*(const uint8_t *)&one == 1 ? XCB_IMAGE_ORDER_LSB_FIRST : XCB_IMAGE_ORDER_MSB_FIRST);
+    if (setup->image_byte_order != byte_order || (screen->root_depth != 24 && screen->root_depth != 32))
+        return false;
+
+    xcb_format_iterator_t formats = xcb_setup_pixmap_formats_iterator(setup);
+    for (; formats.rem; xcb_format_next(&formats)) {
+        if (formats.data->depth == screen->root_depth)
+            return (formats.data->bits_per_pixel == 32);
+    }
+    return false;
+}
+
+/*
+ * Takes a screenshot of the root window at the given resolution. Needs to be
+ * called before the lock window is mapped. Returns NULL if the screenshot
+ * could not be taken.
+ *
+ */
+cairo_surface_t *take_screenshot(uint32_t *resolution) {
+    if (!root_format_supported()) {
+        fprintf(stderr, "i3lock: cannot take a screenshot of a %d-bit root window\n", screen->root_depth);
+        return NULL;
+    }
+
+    cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_RGB24, resolution[0], resolution[1]);
+    if (cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS) {
+        cairo_surface_destroy(surface);
+        return NULL;
+    }
+
+    cairo_surface_flush(surface);
+    if (!download_image(conn, screen->root, resolution[0], resolution[1],
+                        cairo_image_surface_get_data(surface),
+                        cairo_image_surface_get_stride(surface))) {
+        fprintf(stderr, "i3lock: could not take a screenshot\n");
+        cairo_surface_destroy(surface);
+        return NULL;
+    }
+    cairo_surface_mark_dirty(surface);
+
+    DEBUG("took a %d x %d screenshot\n", resolution[0], resolution[1]);
+    return surface;
+}
+
+/* Up to this radius, averages computed with box_blur_scale() are off by at
+ * most 1. */
+#define MAX_BLUR_RADIUS 32767
+
+/*
+ * Returns the factor which divides a sum over size pixels by size when
+ * multiplied with it and shifted right by 24, i.e. a fixed-point reciprocal.
+ * It is rounded down, so that the average never exceeds 255, and a sum (at
+ * most 255 * size) times the factor fits into 32 bits.
+ *
+ */
+static uint32_t box_blur_scale(uint32_t size) {
+    return (1U << 24) / size;
+}
+
+/*
+ * Averages each pixel of src with the radius pixels to its left and right,
+ * writing the result to dst. Pixels past the edges are treated like the
+ * pixels at the edges. Only works on one row, the running sums need to be
+ * updated one pixel after the other.
+ *
+ */
+static void box_blur_row(const uint32_t *src, uint32_t *dst, int width, int radius) {
+    const uint32_t size = 2 * radius + 1;
+    const uint32_t scale = box_blur_scale(size);
+    uint32_t sums[4] = {0, 0, 0, 0};
+
+    for (int x = -radius - 1; x < radius; x++) {
+        uint32_t pixel = src[x < 0 ? 0 : (x >= width ? width - 1 : x)];
+        for (int c = 0; c < 4; c++)
+            sums[c] += (pixel >> (c * 8)) & 0xff;
+    }
+
+    for (int x = 0; x < width; x++) {
+        uint32_t entering = src[x + radius < width ? x + radius : width - 1];
+        uint32_t leaving = src[x - radius - 1 > 0 ? x - radius - 1 : 0];
+        uint32_t out = 0;
+        for (int c = 0; c < 4; c++) {
+            sums[c] += ((entering >> (c * 8)) & 0xff) - ((leaving >> (c * 8)) & 0xff);
+            out |= ((sums[c] * scale) >> 24) << (c * 8);
+        }
+        dst[x] = out;
+    }
+}
+
+/*
+ * Like box_blur_row(), but averages each pixel with the pixels above and
+ * below it. The running sums are kept for a whole row, so that the inner
+ * loops run over adjacent pixels without branches. Dividing by size is done
+ * by multiplying with a fixed-point reciprocal, since there is no vector
+ * integer division, so that compilers can vectorize these loops (e.g. GCC
+ * with -O3).
+ *
+ */
+static void box_blur_columns(const uint32_t *src, uint32_t *dst, uint32_t *sums,
+                             int width, int height, int stride, int radius) {
+    const uint32_t size = 2 * radius + 1;
+    const uint32_t scale = box_blur_scale(size);
+    memset(sums, 0, width * 4 * sizeof(uint32_t));
+
+    for (int y = -radius - 1; y < radius; y++) {
+        const uint32_t *row = src + (y < 0 ? 0 : (y >= height ? height - 1 : y)) * stride;
+        for (int x = 0; x < width; x++)
+            for (int c = 0; c < 4; c++)
+                sums[x * 4 + c] += (row[x] >> (c * 8)) & 0xff;
+    }
+
+    for (int y = 0; y < height; y++) {
+        const uint32_t *entering = src + (y + radius < height ? y + radius : height - 1) * stride;
+        const uint32_t *leaving = src + (y - radius - 1 > 0 ? y - radius - 1 : 0) * stride;
+        uint32_t *out = dst + y * stride;
+        for (int x = 0; x < width; x++) {
+            uint32_t pixel = 0;
+            for (int c = 0; c < 4; c++) {
+                sums[x * 4 + c] += ((entering[x] >> (c * 8)) & 0xff) - ((leaving[x] >> (c * 8)) & 0xff);
+                pixel |= ((sums[x * 4 + c] * scale) >> 24) << (c * 8);
+            }
+            out[x] = pixel;
+        }
+    }
+}
+
+/*
+ * Blurs the given image surface in place. Three box blurs in a row come
+ * close to a gaussian blur, and each of them takes the same time regardless
+ * of the radius.
+ *
+ */
+void blur_image(cairo_surface_t *surface, int radius) {
+    int width = cairo_image_surface_get_width(surface);
+    int height = cairo_image_surface_get_height(surface);
+    int stride = cairo_image_surface_get_stride(surface) / 4;
+    if (radius <= 0 || width == 0 || height == 0)
+        return;
+    if (radius > MAX_BLUR_RADIUS)
+        radius = MAX_BLUR_RADIUS;
+
+    uint32_t *tmp = malloc(stride * height * sizeof(uint32_t));
+    uint32_t *sums = malloc(width * 4 * sizeof(uint32_t));
+    if (tmp == NULL || sums == NULL) {
+        free(tmp);
+        free(sums);
+        return;
+    }
+
+    cairo_surface_flush(surface);
+    uint32_t *data = (uint32_t *)cairo_image_surface_get_data(surface);
+    for (int pass = 0; pass < 3; pass++) {
+        for (int y = 0; y < height; y++)
+            box_blur_row(data + y * stride, tmp + y * stride, width, radius);
+        box_blur_columns(tmp, data, sums, width, height, stride, radius);
+    }
+    cairo_surface_mark_dirty(surface);
+
+    free(tmp);
+    free(sums);
+}
+
+/*
+ * Pixelates the given image surface in place, using blocks of size x size
+ * pixels. The image is scaled down (averaging each block) and then up again
+ * without interpolation, so that pixman does all the work.
+ *
+ */
+void pixelate_image(cairo_surface_t *surface, int size) {
+    int width = cairo_image_surface_get_width(surface);
+    int height = cairo_image_surface_get_height(surface);
+    if (size <= 1 || width == 0 || height == 0)
+        return;
+
+    int small_width = (width + size - 1) / size;
+    int small_height = (height + size - 1) / size;
+    cairo_surface_t *small = cairo_image_surface_create(cairo_image_surface_get_format(surface), small_width, small_height);
+    if (cairo_surface_status(small) != CAIRO_STATUS_SUCCESS) {
+        cairo_surface_destroy(small);
+        return;
+    }
+
+    cairo_t *ctx = cairo_create(small);
+    cairo_scale(ctx, 1.0 / size, 1.0 / size);
+    cairo_set_source_surface(ctx, surface, 0, 0);
+    cairo_pattern_set_filter(cairo_get_source(ctx), CAIRO_FILTER_GOOD);
+    cairo_set_operator(ctx, CAIRO_OPERATOR_SOURCE);
+    cairo_paint(ctx);
+    cairo_destroy(ctx);
+
+    ctx = cairo_create(surface);
+    cairo_scale(ctx, size, size);
+    cairo_set_source_surface(ctx, small, 0, 0);
+    cairo_pattern_set_filter(cairo_get_source(ctx), CAIRO_FILTER_NEAREST);
+    cairo_set_operator(ctx, CAIRO_OPERATOR_SOURCE);
+    cairo_paint(ctx);
+    cairo_destroy(ctx);
+
+    cairo_surface_destroy(small);
+}
+
+/*
+ * Pixelates and blurs the given screen of the screenshot, independently of
+ * the other screens. The screen is accessed through a surface sharing the
+ * memory of the screenshot, so no pixels are copied.
+ *
+ */
+static void filter_screen(const Rect *rect) {
+    unsigned char *data = cairo_image_surface_get_data(work.shot);
+    int stride = cairo_image_surface_get_stride(work.shot);
+    cairo_surface_t *region = cairo_image_surface_create_for_data(
+        data + rect->y * stride + rect->x * 4, cairo_image_surface_get_format(work.shot),
+        rect->width, rect->height, stride);
+
+    if (work.pixelate_size > 0)
+        pixelate_image(region, work.pixelate_size);
+    if (work.blur_radius > 0)
+        blur_image(region, work.blur_radius);
+
+    cairo_surface_finish(region);
+    cairo_surface_destroy(region);
+}
+
+/*
+ * Filters screens until there are none left.
+ *
+ */
+static void *filter_worker(void *arg) {
+    for (;;) {
+        pthread_mutex_lock(&work.lock);
+        int idx = work.next++;
+        pthread_mutex_unlock(&work.lock);
+        if (idx >= work.screens_count)
+            return NULL;
+        filter_screen(&work.screens[idx]);
+    }
+}
+
+/*
+ * Returns whether the given rectangles overlap.
+ *
+ */
+static bool rects_overlap(const Rect *a, const Rect *b) {
+    return (a->x < b->x + b->width && b->x < a->x + a->width &&
+            a->y < b->y + b->height && b->y < a->y + a->height);
+}
+
+/*
+ * Pixelates (if pixelate_size > 0) and blurs (if blur_radius > 0) the
+ * screenshot. Each of the given screens is filtered on its own, so that
+ * neither blurring nor pixel blocks cross the edges of a monitor, and the
+ * screens are spread over a few threads. Without screens, the whole
+ * screenshot is filtered at once.
+ *
+ */
+void filter_screenshot(cairo_surface_t *shot, const Rect *screens, int screens_count,
+                       int pixelate_size, int blur_radius) {
+    int width = cairo_image_surface_get_width(shot);
+    int height = cairo_image_surface_get_height(shot);
+    Rect whole = {0, 0, width, height};
+    if (screens_count == 0) {
+        screens = &whole;
+        screens_count = 1;
+    }
+
+    if ((work.screens = calloc(screens_count, sizeof(Rect))) == NULL)
+        return;
+    work.shot = shot;
+    work.screens_count = 0;
+    work.pixelate_size = pixelate_size;
+    work.blur_radius = blur_radius;
+    work.next = 0;
+
+    /* Screens may only be filtered in parallel if they do not share any
+     * pixels. Cloned outputs are the same screen, so they are filtered once,
+     * anything else overlapping is filtered serially. */
+    bool overlapping = false;
+    for (int i = 0; i < screens_count; i++) {
+        Rect rect = screens[i];
+        if (rect.x < 0 || rect.y < 0 || rect.x >= width || rect.y >= height)
+            continue;
+        if (rect.x + rect.width > width)
+            rect.width = width - rect.x;
+        if (rect.y + rect.height > height)
+            rect.height = height - rect.y;
+
+        bool duplicate = false;
+        for (int j = 0; j < work.screens_count; j++) {
+            const Rect *other = &work.screens[j];
+            if (other->x == rect.x && other->y == rect.y &&
+                other->width == rect.width && other->height == rect.height)
+                duplicate = true;
+            else if (rects_overlap(other, &rect))
+                overlapping = true;
+        }
+        if (!duplicate)
+            work.screens[work.screens_count++] = rect;
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = (overlapping ? 1 : work.screens_count);
+    if (threads > MAX_FILTER_THREADS)
+        threads = MAX_FILTER_THREADS;
+    if (cpus > 0 && threads > cpus)
+        threads = cpus;
+
+    cairo_surface_flush(shot);
+
+    /* The calling thread does its share of the work, too. */
+    pthread_t workers[MAX_FILTER_THREADS - 1];
+    int started = 0;
+    for (; started < threads - 1; started++) {
+        if (pthread_create(&workers[started], NULL, filter_worker, NULL) != 0)
+            break;
+    }
+    filter_worker(NULL);
+    for (int i = 0; i < started; i++)
+        pthread_join(workers[i], NULL);
+
+    DEBUG("filtered %d screens of the screenshot using %d threads\n", work.screens_count, started + 1);
+    cairo_surface_mark_dirty(shot);
+    free(work.screens);
+    work.screens = NULL;
+}
@@ -0,0 +1,14 @@
+#ifndef _SCREENSHOT_H
+#define _SCREENSHOT_H
+
+#include <cairo.h>
+
+#include "xinerama.h"
+
+cairo_surface_t *take_screenshot(uint32_t *resolution);
+void blur_image(cairo_surface_t *surface, int radius);
+void pixelate_image(cairo_surface_t *surface, int size);
+void filter_screenshot(cairo_surface_t *shot, const Rect *screens, int screens_count,
+                       int pixelate_size, int blur_radius);
+
+#endif
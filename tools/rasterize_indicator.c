@@ -0,0 +1,201 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * © 2010 Michael Stapelberg
+ *
+ * See LICENSE for licensing information
+ *
+ * Pre-rasterizes the layers of the built-in unlock indicator (button.h) at
+ * the common scaling factors and writes them to stdout as a C header, so that
+ * i3lock does not need to parse and render the SVG on startup.
+ *
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <err.h>
+#include <cairo.h>
+#include <librsvg/rsvg.h>
+
+#include "../button.h"
+
+/* Scaling factors to pre-rasterize, i.e. 96, 144 and 192 dpi. */
+static const double scales[] = {1.0, 1.5, 2.0};
+#define SCALES_COUNT (sizeof(scales) / sizeof(scales[0]))
+
+/* Needs to be kept in sync with LAYER_* in unlock_indicator.c. */
+static const char *layer_ids[] = {"#bg", "#fg", "#idle", "#verify", "#fail", "#backspace"};
+#define NAMED_LAYERS (sizeof(layer_ids) / sizeof(layer_ids[0]))
+
+/*
+ * Writes the SVG id of the given layer (see layer_ids) to id, which needs
+ * to hold 9 bytes.
+ *
+ */
+static void layer_id(int idx, char *id) {
+    if (idx < (int)NAMED_LAYERS)
+        snprintf(id, 9, "%s", layer_ids[idx]);
+    else
+        snprintf(id, 9, "#anim%02d", idx - (int)NAMED_LAYERS);
+}
+
+/*
+ * Writes the pixels of the given rectangle of surface as an array named
+ * name. Transparent pixels make up most of each layer, so every run of them
+ * is written as a zero followed by the length of the run. Runs do not cross
+ * rows.
+ *
+ */
+static void write_pixels(const char *name, cairo_surface_t *surface, int x, int y, int width, int height) {
+    unsigned char *data = cairo_image_surface_get_data(surface);
+    int stride = cairo_image_surface_get_stride(surface);
+    int column = 0;
+
+    printf("static const uint32_t %s[] = {", name);
+    for (int row = y; row < y + height; row++) {
+        uint32_t *pixels = (uint32_t *)(data + row * stride);
+        for (int col = x; col < x + width;) {
+            uint32_t words[2] = {pixels[col], 0};
+            int count = 1;
+            if (pixels[col] == 0) {
+                while (col < x + width && pixels[col] == 0) {
+                    words[1]++;
+                    col++;
+                }
+                count = 2;
+            } else {
+                col++;
+            }
+            for (int i = 0; i < count; i++) {
+                printf("%s0x%08x,", (column % 8 == 0 ? "\n    " : " "), words[i]);
+                column++;
+            }
+        }
+    }
+    printf("\n};\n\n");
+}
+
+/*
+ * Renders the given layer at the given scaling factor and writes the part
+ * which is not transparent. Fills in the position and size of that part, or
+ * a size of 0 if the layer is empty or missing.
+ *
+ */
+static void write_layer(RsvgHandle *svg, const char *name, const char *id, double scale,
+                        int width, int height, int *bounds) {
+    bounds[0] = bounds[1] = bounds[2] = bounds[3] = 0;
+    if (rsvg_handle_has_sub(svg, id) != TRUE)
+        return;
+
+    cairo_surface_t *full = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+    cairo_t *ctx = cairo_create(full);
+    cairo_scale(ctx, scale, scale);
+    rsvg_handle_render_cairo_sub(svg, ctx, id);
+    cairo_destroy(ctx);
+    cairo_surface_flush(full);
+
+    /* Crop the same way as crop_to_content() in unlock_indicator.c. */
+    unsigned char *data = cairo_image_surface_get_data(full);
+    int stride = cairo_image_surface_get_stride(full);
+    int min_x = width, min_y = height, max_x = -1, max_y = -1;
+    for (int row = 0; row < height; row++) {
+        uint32_t *pixels = (uint32_t *)(data + row * stride);
+        for (int col = 0; col < width; col++) {
+            if ((pixels[col] >> 24) == 0)
+                continue;
+            if (col < min_x)
+                min_x = col;
+            if (col > max_x)
+                max_x = col;
+            if (row < min_y)
+                min_y = row;
+            max_y = row;
+        }
+    }
+
+    if (max_x >= 0) {
+        bounds[0] = min_x;
+        bounds[1] = min_y;
+        bounds[2] = max_x - min_x + 1;
+        bounds[3] = max_y - min_y + 1;
+        write_pixels(name, full, bounds[0], bounds[1], bounds[2], bounds[3]);
+    }
+    cairo_surface_destroy(full);
+}
+
+int main(void) {
+    GError *e = NULL;
+    RsvgHandle *svg = rsvg_handle_new_from_data(button_svg, sizeof(button_svg), &e);
+    if (e != NULL)
+        errx(EXIT_FAILURE, "Could not load indicator SVG: %s", e->message);
+
+    RsvgDimensionData dimensions;
+    rsvg_handle_get_dimensions(svg, &dimensions);
+
+    int anim_layer_count = 0;
+    for (; anim_layer_count < 100; anim_layer_count++) {
+        char anim_id[9];
+        snprintf(anim_id, sizeof(anim_id), "#anim%02d", anim_layer_count);
+        if (rsvg_handle_has_sub(svg, anim_id) != TRUE)
+            break;
+    }
+    int layers_count = NAMED_LAYERS + anim_layer_count;
+
+    printf("/* Generated from button.h by tools/rasterize_indicator, do not edit. */\n\n");
+    printf("#define BUTTON_SVG_WIDTH %d\n", dimensions.width);
+    printf("#define BUTTON_SVG_HEIGHT %d\n", dimensions.height);
+    printf("#define BUTTON_ANIM_LAYERS %d\n", anim_layer_count);
+    printf("#define BUTTON_REMOVE_BACKGROUND %s\n",
+           (rsvg_handle_has_sub(svg, "#remove_background") == TRUE ? "true" : "false"));
+    printf("#define BUTTON_SEQUENTIAL_ANIMATION %s\n\n",
+           (rsvg_handle_has_sub(svg, "#sequential_animation") == TRUE ? "true" : "false"));
+
+    printf("typedef struct button_bitmap {\n"
+           "    int x;\n"
+           "    int y;\n"
+           "    int width;\n"
+           "    int height;\n"
+           "    const uint32_t *data;\n"
+           "} button_bitmap_t;\n\n");
+
+    int (*bounds)[4] = calloc(SCALES_COUNT * layers_count, sizeof(*bounds));
+    if (bounds == NULL)
+        err(EXIT_FAILURE, "calloc");
+
+    for (size_t s = 0; s < SCALES_COUNT; s++) {
+        int width = ceil(scales[s] * dimensions.width);
+        int height = ceil(scales[s] * dimensions.height);
+        for (int l = 0; l < layers_count; l++) {
+            char id[9], name[64];
+            layer_id(l, id);
+            snprintf(name, sizeof(name), "button_bitmap_%zu_%s", s, id + 1);
+            write_layer(svg, name, id, scales[s], width, height, bounds[s * layers_count + l]);
+        }
+    }
+
+    printf("static const struct {\n"
+           "    double scale;\n"
+           "    button_bitmap_t layers[%d];\n"
+           "} button_bitmaps[] = {\n",
+           layers_count);
+    for (size_t s = 0; s < SCALES_COUNT; s++) {
+        printf("    {%.2f, {\n", scales[s]);
+        for (int l = 0; l < layers_count; l++) {
+            int *b = bounds[s * layers_count + l];
+            char id[9];
+            layer_id(l, id);
+            if (b[2] == 0)
+                printf("        {0, 0, 0, 0, NULL},\n");
+            else
+                printf("        {%d, %d, %d, %d, button_bitmap_%zu_%s},\n", b[0], b[1], b[2], b[3], s, id + 1);
+        }
+        printf("    }},\n");
+    }
+    printf("};\n");
+
+    free(bounds);
+    g_object_unref(svg);
+    return EXIT_SUCCESS;
+}
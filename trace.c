@@ -0,0 +1,200 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * © 2010 Michael Stapelberg
+ *
+ * See LICENSE for licensing information
+ *
+ * trace.c: records how long each key press takes until the resulting redraw
+ *          is flushed to the X server, see --trace-keys. Only timing is
+ *          recorded, never which key was pressed.
+ *
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <err.h>
+#include <xcb/xcb.h>
+
+#include "trace.h"
+#include "unlock_indicator.h"
+
+/* Number of key presses kept, older ones are overwritten. */
+#define TRACE_CAPACITY 1024
+
+/* Number of rasterized layers recorded per key press. */
+#define TRACE_MAX_LAYERS 8
+
+/* The timing of one key press. All times are in milliseconds since
+ * trace_init(), or negative if the step did not happen. */
+typedef struct key_trace {
+    /* X server timestamp of the KeyPress event (in the X server’s clock). */
+    uint32_t event_time;
+    /* When handle_key_press() began. */
+    double received;
+    /* When the XKB keysym lookup and compose handling were done. */
+    double looked_up;
+    /* How long draw_image() took for the redraw showing this key press. */
+    double render_ms;
+    /* Layers which had to be rasterized by librsvg during that redraw. */
+    int layers_count;
+    struct {
+        int layer;
+        double ms;
+    } layers[TRACE_MAX_LAYERS];
+    /* When the redraw was flushed to the X server. */
+    double flushed;
+} key_trace_t;
+
+static bool trace_enabled = false;
+static const char *trace_path;
+static struct timespec trace_start;
+
+/* Ring buffer of the last TRACE_CAPACITY key presses. traces_next counts
+ * all key presses so far, traces_pending is the first one whose redraw was
+ * not flushed yet. */
+static key_trace_t traces[TRACE_CAPACITY];
+static uint64_t traces_next = 0;
+static uint64_t traces_pending = 0;
+
+static double render_begin;
+static double layer_begin;
+
+/* Set by trace_render_end(), reset by trace_flushed(). */
+static bool rendered = false;
+
+static double now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - trace_start.tv_sec) * 1000.0 +
+           (now.tv_nsec - trace_start.tv_nsec) / 1000000.0;
+}
+
+/*
+ * Writes all recorded key presses to the trace file, oldest first.
+ *
+ */
+static void trace_dump(void) {
+    FILE *f = fopen(trace_path, "w");
+    if (f == NULL) {
+        warn("Could not write key press trace to %s", trace_path);
+        return;
+    }
+
+    fprintf(f, "# event_time received_ms lookup_ms render_ms flushed_ms latency_ms layers (id:ms)\n");
+    uint64_t first = (traces_next > TRACE_CAPACITY ? traces_next - TRACE_CAPACITY : 0);
+    for (uint64_t i = first; i < traces_next; i++) {
+        const key_trace_t *t = &traces[i % TRACE_CAPACITY];
+        fprintf(f, "%u %.3f %.3f %.3f %.3f %.3f",
+                t->event_time, t->received,
+                (t->looked_up >= 0 ? t->looked_up - t->received : -1),
+                t->render_ms, t->flushed,
+                (t->flushed >= 0 ? t->flushed - t->received : -1));
+        for (int l = 0; l < t->layers_count; l++)
+            fprintf(f, " %d:%.3f", t->layers[l].layer, t->layers[l].ms);
+        fprintf(f, "\n");
+    }
+    fclose(f);
+}
+
+/*
+ * Enables tracing. The trace is written to the given file at exit.
+ *
+ */
+void trace_init(const char *path) {
+    trace_path = path;
+    clock_gettime(CLOCK_MONOTONIC, &trace_start);
+    trace_enabled = true;
+    if (atexit(trace_dump) != 0)
+        errx(EXIT_FAILURE, "Could not set up key press tracing\n");
+}
+
+/*
+ * Starts recording a key press, called before it is handled.
+ *
+ */
+void trace_key_begin(uint32_t event_time) {
+    if (!trace_enabled)
+        return;
+
+    /* The oldest pending key press is about to be overwritten. */
+    if (traces_next - traces_pending == TRACE_CAPACITY)
+        traces_pending++;
+
+    key_trace_t *t = &traces[traces_next++ % TRACE_CAPACITY];
+    t->event_time = event_time;
+    t->received = now_ms();
+    t->looked_up = -1;
+    t->render_ms = -1;
+    t->layers_count = 0;
+    t->flushed = -1;
+}
+
+void trace_key_lookup_done(void) {
+    if (!trace_enabled || traces_next == traces_pending)
+        return;
+    traces[(traces_next - 1) % TRACE_CAPACITY].looked_up = now_ms();
+}
+
+void trace_render_begin(void) {
+    if (!trace_enabled)
+        return;
+    render_begin = now_ms();
+}
+
+/*
+ * Attributes the redraw to all key presses it shows.
+ *
+ */
+void trace_render_end(void) {
+    if (!trace_enabled)
+        return;
+
+    double ms = now_ms() - render_begin;
+    for (uint64_t i = traces_pending; i < traces_next; i++)
+        traces[i % TRACE_CAPACITY].render_ms = ms;
+    rendered = true;
+}
+
+void trace_layer_begin(void) {
+    if (!trace_enabled)
+        return;
+    layer_begin = now_ms();
+}
+
+void trace_layer_end(int layer) {
+    if (!trace_enabled)
+        return;
+
+    double ms = now_ms() - layer_begin;
+    for (uint64_t i = traces_pending; i < traces_next; i++) {
+        key_trace_t *t = &traces[i % TRACE_CAPACITY];
+        if (t->layers_count == TRACE_MAX_LAYERS)
+            continue;
+        t->layers[t->layers_count].layer = layer;
+        t->layers[t->layers_count].ms = ms;
+        t->layers_count++;
+    }
+}
+
+/*
+ * Called after the X11 connection was flushed. Key presses whose redraw was
+ * flushed are done. If a redraw is still queued (see redraw_rate), their
+ * pixels are not on the screen yet and they stay pending.
+ *
+ */
+void trace_flushed(void) {
+    if (!trace_enabled || traces_next == traces_pending)
+        return;
+
+    if (!rendered && redraw_is_queued())
+        return;
+
+    double flushed = now_ms();
+    for (uint64_t i = traces_pending; i < traces_next; i++)
+        traces[i % TRACE_CAPACITY].flushed = flushed;
+    traces_pending = traces_next;
+    rendered = false;
+}
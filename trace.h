@@ -0,0 +1,16 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+void trace_init(const char *path);
+void trace_key_begin(uint32_t event_time);
+void trace_key_lookup_done(void);
+void trace_render_begin(void);
+void trace_render_end(void);
+void trace_layer_begin(void);
+void trace_layer_end(int layer);
+void trace_flushed(void);
+
+#endif
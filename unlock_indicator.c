@@ -7,10 +7,13 @@
  *
  */
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <ctype.h>
 #include <math.h>
+#include <err.h>
 #include <xcb/xcb.h>
 #include <ev.h>
 #include <cairo.h>
@@ -21,6 +24,12 @@
 #include "xcb.h"
 #include "unlock_indicator.h"
 #include "xinerama.h"
+#include "randr.h"
+#include "trace.h"
+#include "atlas.h"
+#include "cache.h"
+#include "button.h"
+#include "button_bitmaps.h"
 
 /*******************************************************************************
  * Variables defined in i3lock.c.
@@ -49,10 +58,14 @@ extern cairo_surface_t *img;
 
 /* Whether the image should be tiled. */
 extern bool tile;
+
+/* How the image is placed (and scaled) on each screen, unless it is tiled. */
+extern image_mode_t image_mode;
 /* The background color to use (in hex). */
 extern char color[7];
 
-/* SVG handle for unlock indicator. */
+/* SVG handle for unlock indicator, NULL until the SVG is needed (see
+ * get_svg()). */
 extern RsvgHandle* svg;
 
 /* Number of animation layers in the SVG */
@@ -64,6 +77,20 @@ extern bool remove_background;
 /* Play animation in sequential order */
 extern bool sequential_animation;
 
+/* Maximum number of redraws per second, 0 for no limit. */
+extern int redraw_rate;
+
+/* The libev main loop, used for pacing redraws. */
+extern struct ev_loop *main_loop;
+
+/* Directory holding our own layer atlases (see atlas.c), which later
+ * instances map, NULL to disable. */
+extern char *indicator_cache_dir;
+
+/* Directory holding layer atlases installed by the administrator, which all
+ * users map, NULL to disable. */
+extern char *indicator_shared_cache_dir;
+
 /*******************************************************************************
  * Variables defined in xcb.c.
  ******************************************************************************/
@@ -75,9 +102,157 @@ extern xcb_screen_t *screen;
  * Local variables.
  ******************************************************************************/
 
+/* Whether the built-in unlock indicator (button.h) is used. Its layers are
+ * pre-rasterized at build time for the common scaling factors (see
+ * button_bitmaps.h), so the SVG only needs to be parsed for other ones. */
+static bool builtin_indicator = false;
+
+/* Contents and path of the indicator SVG given with -s, kept around until the
+ * SVG is parsed by get_svg(). */
+static char *svg_data = NULL;
+static gsize svg_data_len = 0;
+static char *svg_file = NULL;
+
+/* Hash of the indicator SVG, identifying its layer atlases. Only computed
+ * when a layer atlas directory is set. */
+static uint64_t svg_hash = 0;
+
+/* Renders the layers missing from a layer atlas in the background, see
+ * atlas_idle_cb(). */
+static struct ev_idle atlas_idle;
+
+/* Bitmask of the named layers (LAYER_*) which exist in the indicator SVG. */
+static unsigned int named_layers = ~0U;
+
 /* Cache the screen’s visual, necessary for creating a Cairo context. */
 static xcb_visualtype_t *vistype;
 
+/* A 32-bit visual for the ARGB indicator pixmaps, NULL if there is none. */
+static xcb_visualtype_t *argb_vistype;
+
+/* Pixmap holding only the background (color or image). It is rendered once
+ * and only re-rendered when the resolution changes. */
+static xcb_pixmap_t bg_pixmap = XCB_NONE;
+
+/* Pixmap used as the window background: a copy of bg_pixmap with the unlock
+ * indicator drawn on top of it. */
+static xcb_pixmap_t win_pixmap = XCB_NONE;
+
+/* The resolution bg_pixmap and win_pixmap were created with. */
+static uint32_t pixmap_resolution[2];
+
+/* Graphics context for copying between the pixmaps. */
+static xcb_gcontext_t copy_gc = XCB_NONE;
+
+/* Everything needed to size and place the unlock indicator which only
+ * changes with the screen configuration. It is computed on first use by
+ * update_render_context() and thrown away by invalidate_render_context(). */
+static struct render_context {
+    bool valid;
+    /* The resolution the placement was computed for. */
+    uint32_t resolution[2];
+    /* Size of the indicator SVG, in SVG units. */
+    RsvgDimensionData svg_dimensions;
+    /* Scaling factor of the X root window, used for screens RandR does not
+     * know about. */
+    double root_scale;
+    /* Where to draw the unlock indicator (one rectangle per screen), and the
+     * cache (i.e. scaling factor) used for each. */
+    xcb_rectangle_t *rects;
+    struct indicator_cache **rects_cache;
+    int rects_count;
+    int rects_size;
+} render_ctx;
+
+/* Whether the last draw_image() call drew the unlock indicator at the
+ * rectangles in render_ctx. */
+static bool indicator_drawn = false;
+
+/* Areas of the window pixmap which were changed by draw_image() and still
+ * need to be updated on the window. */
+static xcb_rectangle_t *damage = NULL;
+static int damage_count = 0;
+static int damage_size = 0;
+
+/* Whether the whole window needs to be updated, e.g. because the pixmaps
+ * were re-created. */
+static bool damage_all = true;
+
+/* Layers drawn on top of the PAM state layer of the unlock indicator: none,
+ * #backspace, or one of the #animXX frames. */
+#define OVERLAY_NONE 0
+#define OVERLAY_BACKSPACE 1
+#define OVERLAY_ANIM(n) (2 + (n))
+
+/* Named layers of the indicator SVG, see layer_ids. */
+#define LAYER_BG 0
+#define LAYER_FG 1
+#define LAYER_IDLE 2
+#define LAYER_VERIFY 3
+#define LAYER_FAIL 4
+#define LAYER_BACKSPACE 5
+#define LAYER_ANIM(n) (6 + (n))
+
+static const char *layer_ids[] = {"#bg", "#fg", "#idle", "#verify", "#fail", "#backspace"};
+
+/* A layer of the indicator SVG, rasterized once and cropped to its content. */
+typedef struct layer {
+    bool rendered;
+    /* NULL if the layer is empty or does not exist. */
+    cairo_surface_t *surface;
+    /* Position of the surface within the unlock indicator. */
+    int x;
+    int y;
+} layer_t;
+
+/* Composed unlock indicator frames are only cached for every combination of
+ * PAM state and overlay up to this number of animation frames. Above that,
+ * only the layers are cached (keeping memory linear in the layer count) and
+ * each frame is blended from them when drawing. */
+#define MAX_CACHED_FRAMES_ANIM_LAYERS 16
+
+/* The unlock indicator rendered at one scaling factor. Monitors with
+ * different DPI get their own cache, monitors with the same DPI share one. */
+typedef struct indicator_cache {
+    double scale;
+    /* Physical size of the unlock indicator at this scaling factor. */
+    int width;
+    int height;
+
+    /* Rasterized layers, indexed by LAYER_*. Layers are rendered on first
+     * use. */
+    layer_t *layers;
+    int layers_count;
+
+    /* Composed unlock indicator frames, indexed by PAM state and overlay.
+     * The set of layers is fixed once the SVG is loaded, so each combination
+     * only needs to be composed once. Frames are composed on first use and
+     * freed once they are uploaded to frame_pixmaps. */
+    cairo_surface_t **frames;
+    int frames_count;
+
+    /* Frame which is re-used for composing when frames are not cached. */
+    cairo_surface_t *scratch_frame;
+
+    /* Server-side ARGB pixmaps of the composed frames (indexed like frames),
+     * from which the unlock indicator is composited onto each screen. Each
+     * frame is only uploaded once. */
+    xcb_pixmap_t *frame_pixmaps;
+
+    /* Whether our own layer atlas for this scaling factor still needs to be
+     * written, see atlas_idle_cb(). */
+    bool atlas_pending;
+
+    /* Server-side ARGB pixmap scratch_frame is uploaded to when frames are
+     * not cached. */
+    xcb_pixmap_t pixmap;
+    xcb_gcontext_t gc;
+} indicator_cache_t;
+
+/* One cache per scaling factor in use. */
+static indicator_cache_t **caches = NULL;
+static int caches_count = 0;
+
 /* Maintain the current unlock/PAM state to draw the appropriate unlock
  * indicator. */
 unlock_state_t unlock_state;
@@ -86,6 +261,23 @@ pam_state_t pam_state;
 /* Remember current animation frame */
 int current_frame = 0;
 
+/* Whether a redraw was requested via queue_redraw(). */
+static bool redraw_queued = false;
+
+/* When the last redraw happened, in ev_time() seconds. */
+static ev_tstamp last_redraw = 0;
+
+/* Wakes up the event loop for a queued redraw which had to be delayed. */
+static struct ev_timer redraw_pacing_timeout;
+
+/* Whether the monitors were off (DPMS) when a redraw was due. Redraws are
+ * deferred until user input wakes the monitors up, see note_user_input(). */
+static bool monitors_asleep = false;
+
+/* Whether there was user input since the DPMS state was last checked. Input
+ * wakes up the monitors, so redraws caused by it do not need to check. */
+static bool input_since_dpms_check = true;
+
 /*
  * Returns the scaling factor of the current screen. E.g., on a 227 DPI MacBook
  * Pro 13" Retina screen, the scaling factor is 227/96 = 2.36.
@@ -98,32 +290,197 @@ static double scaling_factor(void) {
 }
 
 /*
- * Draws global image with fill color onto a pixmap with the given
- * resolution and returns it.
+ * Returns the scaling factor of the monitor showing the given Xinerama
+ * screen, as reported by RandR. Falls back to the scaling factor of the X
+ * root window if RandR does not know the monitor.
  *
  */
-xcb_pixmap_t draw_image(uint32_t *resolution) {
-    xcb_pixmap_t bg_pixmap = XCB_NONE;
+static double screen_scaling_factor(const Rect *rect) {
+    const int dpi = randr_get_dpi(rect);
+    if (dpi <= 0)
+        return render_ctx.root_scale;
+    return (dpi / 96.0);
+}
 
-    RsvgDimensionData svg_dimensions;
-    rsvg_handle_get_dimensions(svg, &svg_dimensions);
-    int indicator_x_physical = ceil(scaling_factor() * svg_dimensions.width);
-    int indicator_y_physical = ceil(scaling_factor() * svg_dimensions.height);
+/* The built-in unlock indicator is drawn at a pre-rasterized scaling factor
+ * (see button_bitmaps.h) if the scaling factor of the monitor is at most this
+ * far (relatively) off. Monitor DPIs derived from EDID data rarely match 96,
+ * 144 or 192 exactly. */
+#define BUILTIN_SCALE_TOLERANCE 0.1
 
-    if (!vistype)
-        vistype = get_root_visual_type(screen);
+/*
+ * Returns the pre-rasterized scaling factor of the built-in unlock indicator
+ * closest to the given one, if it is within BUILTIN_SCALE_TOLERANCE, or the
+ * given scaling factor otherwise.
+ *
+ */
+static double snap_scaling_factor(double scale) {
+    if (!builtin_indicator)
+        return scale;
+
+    double best = scale;
+    double best_diff = BUILTIN_SCALE_TOLERANCE;
+    for (size_t i = 0; i < sizeof(button_bitmaps) / sizeof(button_bitmaps[0]); i++) {
+        const double diff = fabs(scale / button_bitmaps[i].scale - 1);
+        if (diff <= best_diff) {
+            best = button_bitmaps[i].scale;
+            best_diff = diff;
+        }
+    }
+    return best;
+}
+
+/*
+ * Returns the cache for the given scaling factor, creating it if necessary.
+ *
+ */
+static indicator_cache_t *get_indicator_cache(double scale) {
+    scale = snap_scaling_factor(scale);
+    for (int i = 0; i < caches_count; i++) {
+        if (caches[i]->scale == scale)
+            return caches[i];
+    }
+
+    indicator_cache_t **grown = realloc(caches, (caches_count + 1) * sizeof(indicator_cache_t *));
+    if (!grown)
+        return NULL;
+    caches = grown;
+
+    indicator_cache_t *cache = calloc(1, sizeof(indicator_cache_t));
+    if (!cache)
+        return NULL;
+
+    cache->scale = scale;
+    cache->width = ceil(scale * render_ctx.svg_dimensions.width);
+    cache->height = ceil(scale * render_ctx.svg_dimensions.height);
+    cache->pixmap = XCB_NONE;
+    DEBUG("new indicator cache for scaling factor %.2f (%d x %d)\n",
+          scale, cache->width, cache->height);
+
+    caches[caches_count++] = cache;
+    return cache;
+}
+
+/*
+ * Draws the image on each Xinerama screen, centered and scaled according to
+ * image_mode. The image is uploaded to the X server only once, the scaling
+ * is done by the X server (Cairo uses XRender picture transforms for this).
+ *
+ */
+static void draw_scaled_image(cairo_t *xcb_ctx, uint32_t *resolution) {
+    const int width = cairo_image_surface_get_width(img);
+    const int height = cairo_image_surface_get_height(img);
+    cairo_surface_t *source = cairo_surface_create_similar(
+        cairo_get_target(xcb_ctx), cairo_surface_get_content(img), width, height);
+    cairo_t *upload_ctx = cairo_create(source);
+    cairo_set_source_surface(upload_ctx, img, 0, 0);
+    cairo_set_operator(upload_ctx, CAIRO_OPERATOR_SOURCE);
+    cairo_paint(upload_ctx);
+    cairo_destroy(upload_ctx);
+
+    /* Without information about the screens, the whole X root window is
+     * treated as one screen. */
+    Rect root = {0, 0, resolution[0], resolution[1]};
+    const int count = (xr_screens > 0 ? xr_screens : 1);
+    for (int i = 0; i < count; i++) {
+        const Rect *rect = (xr_screens > 0 ? &xr_resolutions[i] : &root);
+        double scale_x = (double)rect->width / width;
+        double scale_y = (double)rect->height / height;
+        switch (image_mode) {
+            case IMAGE_MODE_FILL:
+                scale_x = scale_y = fmax(scale_x, scale_y);
+                break;
+            case IMAGE_MODE_FIT:
+                scale_x = scale_y = fmin(scale_x, scale_y);
+                break;
+            case IMAGE_MODE_STRETCH:
+                break;
+            default:
+                scale_x = scale_y = 1;
+                break;
+        }
+
+        cairo_save(xcb_ctx);
+        cairo_rectangle(xcb_ctx, rect->x, rect->y, rect->width, rect->height);
+        cairo_clip(xcb_ctx);
+        cairo_translate(xcb_ctx,
+                        rect->x + (rect->width - width * scale_x) / 2,
+                        rect->y + (rect->height - height * scale_y) / 2);
+        cairo_scale(xcb_ctx, scale_x, scale_y);
+        cairo_set_source_surface(xcb_ctx, source, 0, 0);
+        cairo_paint(xcb_ctx);
+        cairo_restore(xcb_ctx);
+    }
+
+    cairo_surface_destroy(source);
+}
+
+/*
+ * Frees the given cache, including its server-side pixmap.
+ *
+ */
+static void free_indicator_cache(indicator_cache_t *cache) {
+    DEBUG("freeing indicator cache for scaling factor %.2f\n", cache->scale);
+    for (int i = 0; i < cache->layers_count; i++) {
+        if (cache->layers[i].surface != NULL)
+            cairo_surface_destroy(cache->layers[i].surface);
+    }
+    free(cache->layers);
+    for (int i = 0; i < cache->frames_count; i++) {
+        if (cache->frames[i] != NULL)
+            cairo_surface_destroy(cache->frames[i]);
+    }
+    free(cache->frames);
+    if (cache->scratch_frame != NULL)
+        cairo_surface_destroy(cache->scratch_frame);
+    for (int i = 0; i < cache->frames_count && cache->frame_pixmaps != NULL; i++) {
+        if (cache->frame_pixmaps[i] != XCB_NONE)
+            xcb_free_pixmap(conn, cache->frame_pixmaps[i]);
+    }
+    free(cache->frame_pixmaps);
+    if (cache->pixmap != XCB_NONE)
+        xcb_free_pixmap(conn, cache->pixmap);
+    if (cache->gc != XCB_NONE)
+        xcb_free_gc(conn, cache->gc);
+    free(cache);
+}
+
+/*
+ * Frees the caches which are not used by any screen anymore, e.g. after a
+ * monitor with a different DPI was disconnected.
+ *
+ */
+static void prune_indicator_caches(void) {
+    int kept = 0;
+    for (int c = 0; c < caches_count; c++) {
+        bool used = false;
+        for (int i = 0; i < render_ctx.rects_count && !used; i++)
+            used = (render_ctx.rects_cache[i] == caches[c]);
+
+        if (used)
+            caches[kept++] = caches[c];
+        else
+            free_indicator_cache(caches[c]);
+    }
+    caches_count = kept;
+}
+
+/*
+ * Renders the background (color, image or tiled image) onto a new pixmap with
+ * the given resolution. This is only done when locking and when the
+ * resolution changes, not on every redraw.
+ *
+ */
+static void draw_background(uint32_t *resolution) {
     bg_pixmap = create_bg_pixmap(conn, screen, resolution, color);
-    /* Initialize cairo: Create one in-memory surface to render the unlock
-     * indicator on, create one XCB surface to actually draw (one or more,
-     * depending on the amount of screens) unlock indicators on. */
-    cairo_surface_t *output = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, indicator_x_physical, indicator_y_physical);
-    cairo_t *ctx = cairo_create(output);
 
     cairo_surface_t *xcb_output = cairo_xcb_surface_create(conn, bg_pixmap, vistype, resolution[0], resolution[1]);
     cairo_t *xcb_ctx = cairo_create(xcb_output);
 
     if (img) {
-        if (!tile) {
+        if (!tile && image_mode != IMAGE_MODE_NONE) {
+            draw_scaled_image(xcb_ctx, resolution);
+        } else if (!tile) {
             cairo_set_source_surface(xcb_ctx, img, 0, 0);
             cairo_paint(xcb_ctx);
         } else {
@@ -148,96 +505,899 @@ xcb_pixmap_t draw_image(uint32_t *resolution) {
         cairo_fill(xcb_ctx);
     }
 
-    if (unlock_indicator &&
-        (unlock_state >= STATE_KEY_PRESSED || pam_state > STATE_PAM_IDLE)) {
-        cairo_scale(ctx, scaling_factor(), scaling_factor());
+    cairo_surface_destroy(xcb_output);
+    cairo_destroy(xcb_ctx);
+}
+
+/*
+ * Frees the background pixmap and the window pixmap, so that they will be
+ * re-created (with the current resolution) on the next draw_image() call.
+ *
+ */
+void free_bg_pixmap(void) {
+    if (bg_pixmap != XCB_NONE) {
+        xcb_free_pixmap(conn, bg_pixmap);
+        bg_pixmap = XCB_NONE;
+    }
+    if (win_pixmap != XCB_NONE) {
+        xcb_free_pixmap(conn, win_pixmap);
+        win_pixmap = XCB_NONE;
+    }
+}
+
+/*
+ * Remembers that the given area of the window pixmap changed and needs to be
+ * updated on the window by the next redraw_screen() call.
+ *
+ */
+static void add_damage(xcb_rectangle_t rect) {
+    if (damage_count == damage_size) {
+        int size = (damage_size == 0 ? 8 : damage_size * 2);
+        xcb_rectangle_t *grown = realloc(damage, size * sizeof(xcb_rectangle_t));
+        /* No memory? Just update the whole window instead. */
+        if (!grown) {
+            damage_all = true;
+            return;
+        }
+        damage = grown;
+        damage_size = size;
+    }
+    damage[damage_count++] = rect;
+}
+
+/*
+ * Calculates the position of the unlock indicator in the middle of each
+ * Xinerama screen (using the scaling factor of that screen) and stores it in
+ * render_ctx.
+ *
+ */
+static void place_indicator(uint32_t *resolution) {
+    int count = (xr_screens > 0 ? xr_screens : 1);
+    render_ctx.rects_count = 0;
+    if (count > render_ctx.rects_size) {
+        xcb_rectangle_t *grown = realloc(render_ctx.rects, count * sizeof(xcb_rectangle_t));
+        /* No memory? Just draw no unlock indicator. */
+        if (!grown)
+            return;
+        render_ctx.rects = grown;
+        indicator_cache_t **grown_cache = realloc(render_ctx.rects_cache, count * sizeof(indicator_cache_t *));
+        if (!grown_cache)
+            return;
+        render_ctx.rects_cache = grown_cache;
+        render_ctx.rects_size = count;
+    }
+
+    if (xr_screens > 0) {
+        for (int screen = 0; screen < xr_screens; screen++) {
+            indicator_cache_t *cache = get_indicator_cache(screen_scaling_factor(&xr_resolutions[screen]));
+            if (!cache)
+                return;
+            render_ctx.rects[screen].x = (xr_resolutions[screen].x + ((xr_resolutions[screen].width / 2) - (cache->width / 2)));
+            render_ctx.rects[screen].y = (xr_resolutions[screen].y + ((xr_resolutions[screen].height / 2) - (cache->height / 2)));
+            render_ctx.rects[screen].width = cache->width;
+            render_ctx.rects[screen].height = cache->height;
+            render_ctx.rects_cache[screen] = cache;
+        }
+    } else {
+        /* We have no information about the screen sizes/positions, so we just
+         * place the unlock indicator in the middle of the X root window and
+         * hope for the best. */
+        indicator_cache_t *cache = get_indicator_cache(render_ctx.root_scale);
+        if (!cache)
+            return;
+        render_ctx.rects[0].x = (resolution[0] / 2) - (cache->width / 2);
+        render_ctx.rects[0].y = (resolution[1] / 2) - (cache->height / 2);
+        render_ctx.rects[0].width = cache->width;
+        render_ctx.rects[0].height = cache->height;
+        render_ctx.rects_cache[0] = cache;
+    }
+    render_ctx.rects_count = count;
+}
+
+/*
+ * Returns the SVG handle of the unlock indicator, parsing the SVG on first
+ * use. The SVG given with -s is parsed once the screen is locked, so if
+ * librsvg rejects it, the built-in unlock indicator is used instead: exiting
+ * would unlock the screen. Nothing has been rendered from the SVG at that
+ * point, since its dimensions are needed first (see
+ * update_render_context()).
+ *
+ */
+static RsvgHandle *get_svg(void) {
+    if (svg != NULL)
+        return svg;
+
+    GError *e = NULL;
+    if (svg_data == NULL) {
+        DEBUG("parsing the built-in unlock indicator SVG\n");
+        svg = rsvg_handle_new_from_data(button_svg, sizeof(button_svg), &e);
+    } else {
+        DEBUG("parsing the unlock indicator SVG %s\n", svg_file);
+        /* The file is passed along so that relative references (e.g. to
+         * images) are resolved like rsvg_handle_new_from_file() does. */
+        GFile *file = g_file_new_for_path(svg_file);
+        GInputStream *stream = g_memory_input_stream_new_from_data(svg_data, svg_data_len, NULL);
+        svg = rsvg_handle_new_from_stream_sync(stream, file, RSVG_HANDLE_FLAGS_NONE, NULL, &e);
+        g_object_unref(stream);
+        g_object_unref(file);
+        g_free(svg_data);
+        svg_data = NULL;
+
+        if (e != NULL) {
+            fprintf(stderr, "i3lock: Could not load indicator SVG %s: %s, using the built-in one.\n",
+                    svg_file, e->message);
+            g_error_free(e);
+            e = NULL;
+            if (svg != NULL) {
+                g_object_unref(svg);
+                svg = NULL;
+            }
+            load_builtin_indicator();
+            named_layers = ~0U;
+            current_frame = 0;
+            svg = rsvg_handle_new_from_data(button_svg, sizeof(button_svg), &e);
+        }
+    }
+    if (e != NULL)
+        errx(EXIT_FAILURE, "Could not load indicator SVG: %s", e->message);
+    return svg;
+}
+
+/*
+ * Computes the render context for the given resolution, unless it is still
+ * valid. This keeps librsvg and the DPI calculations off the keystroke path.
+ *
+ */
+static void update_render_context(uint32_t *resolution) {
+    if (render_ctx.valid &&
+        render_ctx.resolution[0] == resolution[0] &&
+        render_ctx.resolution[1] == resolution[1])
+        return;
+
+    invalidate_render_context();
+
+    if (builtin_indicator) {
+        render_ctx.svg_dimensions.width = BUTTON_SVG_WIDTH;
+        render_ctx.svg_dimensions.height = BUTTON_SVG_HEIGHT;
+    } else {
+        rsvg_handle_get_dimensions(get_svg(), &render_ctx.svg_dimensions);
+    }
+    render_ctx.root_scale = scaling_factor();
+    place_indicator(resolution);
+    prune_indicator_caches();
+    render_ctx.resolution[0] = resolution[0];
+    render_ctx.resolution[1] = resolution[1];
+    render_ctx.valid = true;
+}
+
+/*
+ * Discards the render context, so that the size and placement of the unlock
+ * indicator get re-computed on the next draw_image() call. Needs to be called
+ * whenever the screen configuration (resolution, screens or DPI) changes.
+ *
+ */
+void invalidate_render_context(void) {
+    /* The unlock indicator might move, so it needs to be removed from where
+     * it currently is. */
+    if (indicator_drawn) {
+        for (int i = 0; i < render_ctx.rects_count; i++)
+            add_damage(render_ctx.rects[i]);
+        indicator_drawn = false;
+    }
+    render_ctx.rects_count = 0;
+    render_ctx.valid = false;
+}
+
+/*
+ * Shrinks the given surface to the bounding box of its non-transparent pixels
+ * and stores the offset of that box in x and y. Returns NULL if the surface
+ * is completely transparent. The given surface is destroyed.
+ *
+ */
+static cairo_surface_t *crop_to_content(cairo_surface_t *full, int *x, int *y) {
+    cairo_surface_flush(full);
+    unsigned char *data = cairo_image_surface_get_data(full);
+    int width = cairo_image_surface_get_width(full);
+    int height = cairo_image_surface_get_height(full);
+    int stride = cairo_image_surface_get_stride(full);
+
+    int min_x = width, min_y = height, max_x = -1, max_y = -1;
+    for (int row = 0; row < height; row++) {
+        uint32_t *pixels = (uint32_t *)(data + row * stride);
+        for (int col = 0; col < width; col++) {
+            if ((pixels[col] >> 24) == 0)
+                continue;
+            if (col < min_x)
+                min_x = col;
+            if (col > max_x)
+                max_x = col;
+            if (row < min_y)
+                min_y = row;
+            max_y = row;
+        }
+    }
+
+    if (max_x < 0) {
+        cairo_surface_destroy(full);
+        return NULL;
+    }
+
+    cairo_surface_t *cropped = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, max_x - min_x + 1, max_y - min_y + 1);
+    cairo_t *ctx = cairo_create(cropped);
+    cairo_set_operator(ctx, CAIRO_OPERATOR_SOURCE);
+    cairo_set_source_surface(ctx, full, -min_x, -min_y);
+    cairo_paint(ctx);
+    cairo_destroy(ctx);
+    cairo_surface_destroy(full);
+
+    *x = min_x;
+    *y = min_y;
+    return cropped;
+}
+
+/*
+ * Uses the built-in unlock indicator. Its properties are known at build time,
+ * so the SVG is not parsed here.
+ *
+ */
+void load_builtin_indicator(void) {
+    builtin_indicator = true;
+    anim_layer_count = BUTTON_ANIM_LAYERS;
+    remove_background = BUTTON_REMOVE_BACKGROUND;
+    sequential_animation = BUTTON_SEQUENTIAL_ANIMATION;
+    if (indicator_cache_dir != NULL || indicator_shared_cache_dir != NULL)
+        svg_hash = cache_hash(button_svg, sizeof(button_svg));
+}
+
+/*
+ * Looks up what the indicator SVG contains: the named layers, the number of
+ * #animXX layers and the #remove_background and #sequential_animation flags.
+ * This is a single pass over the id attributes of the document, instead of
+ * asking librsvg about every possible id.
+ *
+ */
+static void scan_svg_ids(const char *data, size_t len) {
+    bool anim_present[100] = {false};
+
+    named_layers = 0;
+    for (size_t i = 1; i + 3 < len; i++) {
+        if (data[i] != 'i' || data[i + 1] != 'd' || !isspace((unsigned char)data[i - 1]))
+            continue;
+
+        size_t pos = i + 2;
+        while (pos < len && isspace((unsigned char)data[pos]))
+            pos++;
+        if (pos >= len || data[pos] != '=')
+            continue;
+        pos++;
+        while (pos < len && isspace((unsigned char)data[pos]))
+            pos++;
+        if (pos >= len || (data[pos] != '"' && data[pos] != '\''))
+            continue;
+
+        const char *id = data + pos + 1;
+        const char *id_end = memchr(id, data[pos], len - (pos + 1));
+        if (id_end == NULL)
+            break;
+        size_t id_len = id_end - id;
+        i = id_end - data;
+
+        if (id_len == 6 && strncmp(id, "anim", 4) == 0 &&
+            id[4] >= '0' && id[4] <= '9' && id[5] >= '0' && id[5] <= '9') {
+            anim_present[(id[4] - '0') * 10 + (id[5] - '0')] = true;
+        } else if (id_len == strlen("remove_background") && strncmp(id, "remove_background", id_len) == 0) {
+            remove_background = true;
+        } else if (id_len == strlen("sequential_animation") && strncmp(id, "sequential_animation", id_len) == 0) {
+            sequential_animation = true;
+        } else {
+            for (size_t l = 0; l < sizeof(layer_ids) / sizeof(layer_ids[0]); l++) {
+                if (strlen(layer_ids[l] + 1) == id_len && strncmp(layer_ids[l] + 1, id, id_len) == 0)
+                    named_layers |= (1U << l);
+            }
+        }
+    }
+
+    /* Animation frames need to be numbered without gaps. */
+    for (anim_layer_count = 0; anim_layer_count < 100 && anim_present[anim_layer_count]; anim_layer_count++)
+        ;
+    DEBUG("indicator SVG has %d animation layers, layers 0x%x\n", anim_layer_count, named_layers);
+}
+
+/*
+ * Loads the indicator SVG from the given file. Only the ids are looked up
+ * here, the SVG is parsed on first use (or by parse_indicator_svg()), so that
+ * loading it does not delay locking the screen.
+ *
+ */
+void load_indicator_svg(const char *path) {
+    GError *e = NULL;
+    if (!g_file_get_contents(path, &svg_data, &svg_data_len, &e))
+        errx(EXIT_FAILURE, "Could not load indicator SVG: %s", e->message);
+    svg_file = strdup(path);
+    scan_svg_ids(svg_data, svg_data_len);
+    if (indicator_cache_dir != NULL || indicator_shared_cache_dir != NULL)
+        svg_hash = cache_hash(svg_data, svg_data_len);
+}
+
+/*
+ * Parses the indicator SVG given with -s, unless that already happened. The
+ * layers of the built-in one are pre-rasterized, so it is left alone.
+ *
+ */
+void parse_indicator_svg(void) {
+    if (!builtin_indicator)
+        (void)get_svg();
+}
+
+/*
+ * Returns the pre-rasterized layers of the built-in unlock indicator at the
+ * given scaling factor, or NULL if there are none.
+ *
+ */
+static const button_bitmap_t *get_builtin_layers(double scale) {
+    if (!builtin_indicator)
+        return NULL;
+
+    for (size_t i = 0; i < sizeof(button_bitmaps) / sizeof(button_bitmaps[0]); i++) {
+        if (fabs(button_bitmaps[i].scale - scale) < 0.001)
+            return button_bitmaps[i].layers;
+    }
+    return NULL;
+}
+
+/*
+ * Decodes a pre-rasterized layer (see tools/rasterize_indicator.c) into an
+ * image surface. Runs of transparent pixels are stored as a zero followed by
+ * the length of the run. Returns NULL if the layer is empty.
+ *
+ */
+static cairo_surface_t *decode_builtin_layer(const button_bitmap_t *bitmap) {
+    if (bitmap->data == NULL)
+        return NULL;
+
+    cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, bitmap->width, bitmap->height);
+    if (cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS) {
+        cairo_surface_destroy(surface);
+        return NULL;
+    }
+
+    unsigned char *data = cairo_image_surface_get_data(surface);
+    int stride = cairo_image_surface_get_stride(surface);
+    const uint32_t *in = bitmap->data;
+    for (int row = 0; row < bitmap->height; row++) {
+        uint32_t *pixels = (uint32_t *)(data + row * stride);
+        for (int col = 0; col < bitmap->width;) {
+            uint32_t pixel = *in++;
+            if (pixel != 0) {
+                pixels[col++] = pixel;
+                continue;
+            }
+            uint32_t run = *in++;
+            memset(pixels + col, 0, run * sizeof(uint32_t));
+            col += run;
+        }
+    }
+    cairo_surface_mark_dirty(surface);
+    return surface;
+}
+
+/*
+ * Rasterizes the given layer of the unlock indicator with librsvg.
+ *
+ */
+static void render_layer(indicator_cache_t *cache, int idx, layer_t *layer) {
+    char anim_id[9];
+    const char *id = layer_ids[idx];
+    if (idx >= LAYER_ANIM(0)) {
+        snprintf(anim_id, sizeof(anim_id), "#anim%02d", idx - LAYER_ANIM(0));
+        id = anim_id;
+    }
+    DEBUG("rendering indicator layer %s at scaling factor %.2f\n", id, cache->scale);
 
-        rsvg_handle_render_cairo_sub(svg, ctx, "#bg");
+    cairo_surface_t *full = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, cache->width, cache->height);
+    cairo_t *ctx = cairo_create(full);
+    cairo_scale(ctx, cache->scale, cache->scale);
+    trace_layer_begin();
+    rsvg_handle_render_cairo_sub(get_svg(), ctx, id);
+    trace_layer_end(idx);
+    cairo_destroy(ctx);
 
+    /* Most layers only cover a small part of the indicator, so we only
+     * keep that part in memory. */
+    layer->surface = crop_to_content(full, &layer->x, &layer->y);
+    layer->rendered = true;
+}
 
-        /* Use the appropriate color for the different PAM states
-         * (currently verifying, wrong password, or default) */
-        if (!(unlock_state == STATE_KEY_ACTIVE ||
-            unlock_state == STATE_BACKSPACE_ACTIVE) ||
-            !remove_background) {
+/*
+ * Takes all layers of the given cache from a layer atlas (see atlas.c),
+ * preferring the shared one over our own. Returns false if there is none.
+ *
+ */
+static bool load_atlas_layers(indicator_cache_t *cache) {
+    const char *dirs[] = {indicator_shared_cache_dir, indicator_cache_dir};
+    if (dirs[0] == NULL && dirs[1] == NULL)
+        return false;
+
+    atlas_layer_t *atlas = calloc(cache->layers_count, sizeof(atlas_layer_t));
+    if (atlas == NULL)
+        return false;
+
+    bool loaded = false;
+    for (size_t d = 0; d < sizeof(dirs) / sizeof(dirs[0]) && !loaded; d++) {
+        loaded = (dirs[d] != NULL &&
+                  load_layer_atlas(dirs[d], svg_hash, cache->scale, cache->width,
+                                   cache->height, cache->layers_count, atlas));
+    }
+    for (int i = 0; loaded && i < cache->layers_count; i++) {
+        cache->layers[i].surface = atlas[i].surface;
+        cache->layers[i].x = atlas[i].x;
+        cache->layers[i].y = atlas[i].y;
+        cache->layers[i].rendered = true;
+    }
+    free(atlas);
+    return loaded;
+}
+
+/*
+ * Writes our own layer atlas from the (completely rendered) layers of the
+ * given cache.
+ *
+ */
+static void write_atlas_layers(indicator_cache_t *cache) {
+    atlas_layer_t *atlas = calloc(cache->layers_count, sizeof(atlas_layer_t));
+    if (atlas == NULL)
+        return;
 
-            switch (pam_state) {
-                case STATE_PAM_VERIFY:
-                    rsvg_handle_render_cairo_sub(svg, ctx, "#verify");
-                    break;
-                case STATE_PAM_WRONG:
-                    rsvg_handle_render_cairo_sub(svg, ctx, "#fail");
-                    break;
-                default:
-                    rsvg_handle_render_cairo_sub(svg, ctx, "#idle");
-                    break;
+    for (int i = 0; i < cache->layers_count; i++) {
+        atlas[i].surface = cache->layers[i].surface;
+        atlas[i].x = cache->layers[i].x;
+        atlas[i].y = cache->layers[i].y;
+    }
+    write_layer_atlas(indicator_cache_dir, svg_hash, cache->scale, cache->width,
+                      cache->height, cache->layers_count, atlas);
+    free(atlas);
+}
+
+/*
+ * Renders the layers which are missing from a layer atlas, one per event
+ * loop iteration so that key presses are not delayed, and writes the atlas
+ * once all layers of a cache are rendered.
+ *
+ */
+static void atlas_idle_cb(EV_P_ ev_idle *w, int revents) {
+    for (int c = 0; c < caches_count; c++) {
+        indicator_cache_t *cache = caches[c];
+        if (!cache->atlas_pending)
+            continue;
+
+        for (int i = 0; i < cache->layers_count; i++) {
+            layer_t *layer = &cache->layers[i];
+            if (layer->rendered)
+                continue;
+            if (i < LAYER_ANIM(0) && !(named_layers & (1U << i))) {
+                layer->surface = NULL;
+                layer->rendered = true;
+                continue;
             }
+            render_layer(cache, i, layer);
+            return;
         }
+        write_atlas_layers(cache);
+        cache->atlas_pending = false;
+        return;
+    }
+    ev_idle_stop(main_loop, w);
+}
 
-        /* After the user pressed any valid key or the backspace key, we
-         * highlight a random part of the unlock indicator to confirm this
-         * keypress. */
-        if (unlock_state == STATE_KEY_ACTIVE ||
-            unlock_state == STATE_BACKSPACE_ACTIVE) {
-
-            if(++current_frame >= anim_layer_count)
-                current_frame = 0;
-
-            if (unlock_state == STATE_KEY_ACTIVE) {
-                if(!sequential_animation)
-                    current_frame = rand() % anim_layer_count;
-                char anim_id[9];
-                snprintf(anim_id, sizeof(anim_id), "#anim%02d", current_frame);
-                rsvg_handle_render_cairo_sub(svg, ctx, anim_id);
-            } else {
-                rsvg_handle_render_cairo_sub(svg, ctx, "#backspace");
+/*
+ * Returns the given layer of the unlock indicator, rasterizing it with
+ * librsvg on first use (unless it was pre-rasterized at build time or is
+ * taken from a layer atlas). Returns NULL if the layer is empty or missing.
+ * Without a layer atlas, the remaining layers are rendered in the background
+ * to write one, see atlas_idle_cb().
+ *
+ */
+static layer_t *get_layer(indicator_cache_t *cache, int idx) {
+    const button_bitmap_t *bitmaps = get_builtin_layers(cache->scale);
+    if (cache->layers == NULL) {
+        if ((cache->layers = calloc(LAYER_ANIM(anim_layer_count), sizeof(layer_t))) == NULL)
+            return NULL;
+        cache->layers_count = LAYER_ANIM(anim_layer_count);
+        if (bitmaps == NULL && !load_atlas_layers(cache) && indicator_cache_dir != NULL) {
+            cache->atlas_pending = true;
+            if (!ev_is_active(&atlas_idle)) {
+                ev_idle_init(&atlas_idle, atlas_idle_cb);
+                ev_idle_start(main_loop, &atlas_idle);
             }
+        }
+    }
+
+    layer_t *layer = &cache->layers[idx];
+    if (!layer->rendered && idx < LAYER_ANIM(0) && !(named_layers & (1U << idx))) {
+        /* Not in the SVG, nothing to render. */
+        layer->surface = NULL;
+        layer->rendered = true;
+    } else if (!layer->rendered && bitmaps != NULL) {
+        layer->surface = decode_builtin_layer(&bitmaps[idx]);
+        layer->x = bitmaps[idx].x;
+        layer->y = bitmaps[idx].y;
+        layer->rendered = true;
+    } else if (!layer->rendered) {
+        render_layer(cache, idx, layer);
+    }
+
+    return (layer->surface != NULL ? layer : NULL);
+}
+
+/*
+ * Composites the given layer onto ctx (using the OVER operator).
+ *
+ */
+static void blend_layer(indicator_cache_t *cache, cairo_t *ctx, int idx) {
+    layer_t *layer = get_layer(cache, idx);
+    if (layer == NULL)
+        return;
+    cairo_set_source_surface(ctx, layer->surface, layer->x, layer->y);
+    cairo_paint(ctx);
+}
 
+/*
+ * Composites the unlock indicator for the given PAM state and overlay (see
+ * OVERLAY_NONE) from the cached layers onto the given surface.
+ *
+ */
+static void compose_indicator_frame(indicator_cache_t *cache, cairo_surface_t *output, pam_state_t pam, int overlay) {
+    cairo_t *ctx = cairo_create(output);
+
+    blend_layer(cache, ctx, LAYER_BG);
+
+    /* Use the appropriate color for the different PAM states
+     * (currently verifying, wrong password, or default) */
+    if (overlay == OVERLAY_NONE || !remove_background) {
+        switch (pam) {
+            case STATE_PAM_VERIFY:
+                blend_layer(cache, ctx, LAYER_VERIFY);
+                break;
+            case STATE_PAM_WRONG:
+                blend_layer(cache, ctx, LAYER_FAIL);
+                break;
+            default:
+                blend_layer(cache, ctx, LAYER_IDLE);
+                break;
         }
+    }
+
+    if (overlay == OVERLAY_BACKSPACE)
+        blend_layer(cache, ctx, LAYER_BACKSPACE);
+    else if (overlay != OVERLAY_NONE)
+        blend_layer(cache, ctx, LAYER_ANIM(overlay - OVERLAY_ANIM(0)));
+
+    blend_layer(cache, ctx, LAYER_FG);
+
+    cairo_destroy(ctx);
+}
+
+/*
+ * Returns the unlock indicator for the given PAM state and overlay. For SVGs
+ * with few animation frames, every combination is only composed once, on
+ * first use, and cached afterwards. For SVGs with many animation frames
+ * only the layers are cached and the frame is composed on every call. The
+ * returned surface stays owned by the cache.
+ *
+ */
+static cairo_surface_t *get_indicator_frame(indicator_cache_t *cache, pam_state_t pam, int overlay) {
+    if (anim_layer_count > MAX_CACHED_FRAMES_ANIM_LAYERS) {
+        if (cache->scratch_frame == NULL)
+            cache->scratch_frame = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, cache->width, cache->height);
+
+        cairo_t *ctx = cairo_create(cache->scratch_frame);
+        cairo_set_operator(ctx, CAIRO_OPERATOR_CLEAR);
+        cairo_paint(ctx);
+        cairo_destroy(ctx);
 
-        rsvg_handle_render_cairo_sub(svg, ctx, "#fg");
+        compose_indicator_frame(cache, cache->scratch_frame, pam, overlay);
+        return cache->scratch_frame;
     }
 
-    if (xr_screens > 0) {
-        /* Composite the unlock indicator in the middle of each screen. */
-        for (int screen = 0; screen < xr_screens; screen++) {
-            int x = (xr_resolutions[screen].x + ((xr_resolutions[screen].width / 2) - (indicator_x_physical / 2)));
-            int y = (xr_resolutions[screen].y + ((xr_resolutions[screen].height / 2) - (indicator_y_physical / 2)));
-            cairo_set_source_surface(xcb_ctx, output, x, y);
-            cairo_rectangle(xcb_ctx, x, y, indicator_x_physical, indicator_y_physical);
+    if (cache->frames == NULL) {
+        int count = 3 * OVERLAY_ANIM(anim_layer_count);
+        if ((cache->frames = calloc(count, sizeof(cairo_surface_t *))) == NULL)
+            return NULL;
+        cache->frames_count = count;
+    }
+
+    int idx = pam * OVERLAY_ANIM(anim_layer_count) + overlay;
+    if (cache->frames[idx] == NULL) {
+        DEBUG("composing indicator frame (pam_state = %d, overlay = %d) at scaling factor %.2f\n",
+              pam, overlay, cache->scale);
+        cache->frames[idx] = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, cache->width, cache->height);
+        compose_indicator_frame(cache, cache->frames[idx], pam, overlay);
+    }
+    return cache->frames[idx];
+}
+
+/*
+ * Returns a server-side pixmap holding the unlock indicator for the given PAM
+ * state and overlay. Each cached frame is only uploaded once (via MIT-SHM on
+ * local X11 servers), afterwards only the pixmap is used and the client-side
+ * copy is freed. Returns XCB_NONE if there is no 32-bit visual for ARGB
+ * pixmaps.
+ *
+ */
+static xcb_pixmap_t get_indicator_pixmap(indicator_cache_t *cache, pam_state_t pam, int overlay) {
+    if (argb_vistype == NULL)
+        return XCB_NONE;
+
+    const bool cached = (anim_layer_count <= MAX_CACHED_FRAMES_ANIM_LAYERS);
+    const int idx = pam * OVERLAY_ANIM(anim_layer_count) + overlay;
+    xcb_pixmap_t *pixmap = &cache->pixmap;
+    if (cached) {
+        if (cache->frame_pixmaps == NULL &&
+            (cache->frame_pixmaps = calloc(3 * OVERLAY_ANIM(anim_layer_count), sizeof(xcb_pixmap_t))) == NULL)
+            return XCB_NONE;
+        pixmap = &cache->frame_pixmaps[idx];
+        if (*pixmap != XCB_NONE)
+            return *pixmap;
+    }
+
+    cairo_surface_t *frame = get_indicator_frame(cache, pam, overlay);
+    if (frame == NULL)
+        return XCB_NONE;
+
+    if (*pixmap == XCB_NONE) {
+        *pixmap = xcb_generate_id(conn);
+        xcb_create_pixmap(conn, 32, *pixmap, screen->root, cache->width, cache->height);
+    }
+    if (cache->gc == XCB_NONE) {
+        cache->gc = xcb_generate_id(conn);
+        xcb_create_gc(conn, cache->gc, *pixmap, 0, NULL);
+    }
+
+    cairo_surface_flush(frame);
+    upload_image(conn, *pixmap, cache->gc, cache->width, cache->height, 32,
+                 cairo_image_surface_get_data(frame),
+                 cairo_image_surface_get_stride(frame));
+
+    if (cached) {
+        cairo_surface_destroy(cache->frames[idx]);
+        cache->frames[idx] = NULL;
+    }
+    return *pixmap;
+}
+
+/*
+ * Draws the unlock indicator on top of the background and returns the pixmap
+ * to use as the window background. The pixmap stays owned by this module and
+ * must not be freed by the caller.
+ *
+ */
+xcb_pixmap_t draw_image(uint32_t *resolution) {
+    if (!vistype) {
+        vistype = get_root_visual_type(screen);
+        argb_vistype = get_visual_type_for_depth(screen, 32);
+    }
+
+    if (bg_pixmap != XCB_NONE &&
+        (pixmap_resolution[0] != resolution[0] ||
+         pixmap_resolution[1] != resolution[1]))
+        free_bg_pixmap();
+
+    if (bg_pixmap == XCB_NONE) {
+        draw_background(resolution);
+        win_pixmap = xcb_generate_id(conn);
+        xcb_create_pixmap(conn, screen->root_depth, win_pixmap, screen->root,
+                          resolution[0], resolution[1]);
+        pixmap_resolution[0] = resolution[0];
+        pixmap_resolution[1] = resolution[1];
+        damage_all = true;
+    }
+
+    if (copy_gc == XCB_NONE) {
+        copy_gc = xcb_generate_id(conn);
+        xcb_create_gc(conn, copy_gc, screen->root, 0, NULL);
+    }
+
+    bool visible = (unlock_indicator &&
+                    (unlock_state >= STATE_KEY_PRESSED || pam_state > STATE_PAM_IDLE));
+
+    /* The placement depends on the size of the SVG, so only look at it once
+     * the unlock indicator is shown (i.e. not while locking the screen). */
+    if (visible || indicator_drawn)
+        update_render_context(resolution);
+
+    /* The previously drawn unlock indicators need to be removed, and the new
+     * ones drawn. Both are at the same place, unless the render context was
+     * invalidated (which already took care of the old ones). */
+    if (visible || indicator_drawn) {
+        for (int i = 0; i < render_ctx.rects_count; i++)
+            add_damage(render_ctx.rects[i]);
+    }
+    indicator_drawn = visible;
+
+    /* Restore the background on the server side, no image data needs to be
+     * transferred for this. */
+    if (damage_all) {
+        xcb_copy_area(conn, bg_pixmap, win_pixmap, copy_gc, 0, 0, 0, 0,
+                      resolution[0], resolution[1]);
+    } else {
+        for (int i = 0; i < damage_count; i++)
+            xcb_copy_area(conn, bg_pixmap, win_pixmap, copy_gc,
+                          damage[i].x, damage[i].y, damage[i].x, damage[i].y,
+                          damage[i].width, damage[i].height);
+    }
+
+    if (!visible)
+        return win_pixmap;
+
+    /* After the user pressed any valid key or the backspace key, we
+     * highlight a part of the unlock indicator (selected by
+     * select_animation_frame()) to confirm this keypress. */
+    int overlay = OVERLAY_NONE;
+    if (unlock_state == STATE_KEY_ACTIVE && anim_layer_count > 0)
+        overlay = OVERLAY_ANIM(current_frame);
+    else if (unlock_state == STATE_BACKSPACE_ACTIVE)
+        overlay = OVERLAY_BACKSPACE;
+
+    /* Create one XCB surface to actually draw (one or more, depending on the
+     * amount of screens) unlock indicators on. */
+    cairo_surface_t *xcb_output = cairo_xcb_surface_create(conn, win_pixmap, vistype, resolution[0], resolution[1]);
+    cairo_t *xcb_ctx = cairo_create(xcb_output);
+
+    /* Composite the unlock indicator in the middle of each screen. Screens
+     * with the same scaling factor share one server-side frame, so each
+     * screen only costs a Composite request on the X server. */
+    for (int c = 0; c < caches_count; c++) {
+        cairo_surface_t *source = NULL;
+
+        for (int i = 0; i < render_ctx.rects_count; i++) {
+            if (render_ctx.rects_cache[i] != caches[c])
+                continue;
+
+            if (source == NULL) {
+                xcb_pixmap_t pixmap = get_indicator_pixmap(caches[c], pam_state, overlay);
+                if (pixmap != XCB_NONE) {
+                    source = cairo_xcb_surface_create(conn, pixmap, argb_vistype, caches[c]->width, caches[c]->height);
+                } else {
+                    /* Without ARGB pixmaps, Cairo has to upload the frame for
+                     * every screen. */
+                    cairo_surface_t *frame = get_indicator_frame(caches[c], pam_state, overlay);
+                    if (frame == NULL)
+                        break;
+                    source = cairo_surface_reference(frame);
+                }
+            }
+
+            cairo_set_source_surface(xcb_ctx, source, render_ctx.rects[i].x, render_ctx.rects[i].y);
+            cairo_rectangle(xcb_ctx, render_ctx.rects[i].x, render_ctx.rects[i].y,
+                            render_ctx.rects[i].width, render_ctx.rects[i].height);
             cairo_fill(xcb_ctx);
         }
-    } else {
-        /* We have no information about the screen sizes/positions, so we just
-         * place the unlock indicator in the middle of the X root window and
-         * hope for the best. */
-        int x = (last_resolution[0] / 2) - (indicator_x_physical / 2);
-        int y = (last_resolution[1] / 2) - (indicator_y_physical / 2);
-        cairo_set_source_surface(xcb_ctx, output, x, y);
-        cairo_rectangle(xcb_ctx, x, y, indicator_x_physical, indicator_y_physical);
-        cairo_fill(xcb_ctx);
+
+        if (source != NULL)
+            cairo_surface_destroy(source);
     }
 
     cairo_surface_destroy(xcb_output);
-    cairo_surface_destroy(output);
-    cairo_destroy(ctx);
     cairo_destroy(xcb_ctx);
-    return bg_pixmap;
+    return win_pixmap;
 }
 
 /*
- * Calls draw_image on a new pixmap and swaps that with the current pixmap
+ * Calls draw_image on the window pixmap and updates the window with it. The
+ * requests are not flushed, this is left to the caller (usually
+ * xcb_prepare_cb, right before the event loop blocks).
  *
  */
 void redraw_screen(void) {
     DEBUG("redraw_screen(unlock_state = %d, pam_state = %d)\n", unlock_state, pam_state);
-    xcb_pixmap_t bg_pixmap = draw_image(last_resolution);
-    xcb_change_window_attributes(conn, win, XCB_CW_BACK_PIXMAP, (uint32_t[1]){bg_pixmap});
-    /* XXX: Possible optimization: Only update the area in the middle of the
-     * screen instead of the whole screen. */
-    xcb_clear_area(conn, 0, win, 0, 0, last_resolution[0], last_resolution[1]);
-    xcb_free_pixmap(conn, bg_pixmap);
-    xcb_flush(conn);
+    trace_render_begin();
+    xcb_pixmap_t pixmap = draw_image(last_resolution);
+    trace_render_end();
+    /* Set the background pixmap again, the server is not required to pick up
+     * changes made to a pixmap after it was set as the background. */
+    xcb_change_window_attributes(conn, win, XCB_CW_BACK_PIXMAP, (uint32_t[1]){pixmap});
+    /* Only update the areas which actually changed, usually just the unlock
+     * indicator in the middle of each screen. */
+    if (damage_all) {
+        xcb_clear_area(conn, 0, win, 0, 0, last_resolution[0], last_resolution[1]);
+    } else {
+        for (int i = 0; i < damage_count; i++)
+            xcb_clear_area(conn, 0, win, damage[i].x, damage[i].y,
+                           damage[i].width, damage[i].height);
+    }
+    damage_count = 0;
+    damage_all = false;
+}
+
+static void redraw_pacing_cb(EV_P_ ev_timer *w, int revents) {
+    process_queued_redraw();
+}
+
+/*
+ * Requests a redraw. Event handlers only update the state and call this, the
+ * actual redraw happens in process_queued_redraw(), so that bursts of events
+ * only cause one redraw.
+ *
+ */
+void queue_redraw(void) {
+    redraw_queued = true;
+}
+
+/*
+ * Returns whether a redraw was queued but did not happen yet.
+ *
+ */
+bool redraw_is_queued(void) {
+    return redraw_queued;
+}
+
+/*
+ * Redraws the screen if a redraw was queued, but at most redraw_rate times
+ * per second. If the last redraw was too recent, a timer is started to redraw
+ * once the frame interval has passed. Called from xcb_prepare_cb, i.e. before
+ * the event loop blocks.
+ *
+ */
+void process_queued_redraw(void) {
+    if (!redraw_queued || monitors_asleep)
+        return;
+
+    /* Nobody would see redraws caused by timers (e.g. the unlock indicator
+     * fading out) while the monitors are off, so we defer them and wait for
+     * input, without waking up in the meantime. */
+    if (!input_since_dpms_check && dpms_monitors_off(conn)) {
+        DEBUG("monitors are off, deferring redraw\n");
+        monitors_asleep = true;
+        set_pointer_wakeup(conn, true);
+        return;
+    }
+    input_since_dpms_check = false;
+
+    ev_tstamp now = ev_time();
+    ev_tstamp interval = (redraw_rate > 0 ? 1.0 / redraw_rate : 0);
+    if (now - last_redraw < interval) {
+        if (!ev_is_active(&redraw_pacing_timeout)) {
+            ev_timer_init(&redraw_pacing_timeout, redraw_pacing_cb, interval - (now - last_redraw), 0.);
+            ev_timer_start(main_loop, &redraw_pacing_timeout);
+        }
+        return;
+    }
+
+    if (ev_is_active(&redraw_pacing_timeout))
+        ev_timer_stop(main_loop, &redraw_pacing_timeout);
+    redraw_queued = false;
+    last_redraw = now;
+    redraw_screen();
+}
+
+/*
+ * Called for every key press and, while the monitors are off, for pointer
+ * events. Input wakes up the monitors, so a deferred redraw is done now.
+ *
+ */
+void note_user_input(void) {
+    input_since_dpms_check = true;
+    if (monitors_asleep) {
+        DEBUG("monitors woke up, catching up with the deferred redraw\n");
+        monitors_asleep = false;
+        set_pointer_wakeup(conn, false);
+    }
+}
+
+/*
+ * Selects the animation frame to highlight for the current keypress: the
+ * next one if the SVG requests sequential animation, a random one otherwise.
+ *
+ */
+void select_animation_frame(void) {
+    if (anim_layer_count == 0)
+        return;
+
+    if (++current_frame >= anim_layer_count)
+        current_frame = 0;
+
+    if (unlock_state == STATE_KEY_ACTIVE && !sequential_animation)
+        current_frame = rand() % anim_layer_count;
 }
 
 /*
@@ -250,5 +1410,5 @@ void clear_indicator(void) {
         unlock_state = STATE_STARTED;
     } else
         unlock_state = STATE_KEY_PRESSED;
-    redraw_screen();
+    queue_redraw();
 }
@@ -16,8 +16,28 @@ typedef enum {
     STATE_PAM_WRONG = 2   /* the password was wrong */
 } pam_state_t;
 
+typedef enum {
+    IMAGE_MODE_NONE = 0,   /* draw the image once at the top left corner */
+    IMAGE_MODE_CENTER = 1, /* center the unscaled image on each screen */
+    IMAGE_MODE_FILL = 2,   /* scale the image to cover each screen, keeping
+                               its aspect ratio (cropping it) */
+    IMAGE_MODE_FIT = 3,    /* scale the image to fit into each screen,
+                               keeping its aspect ratio */
+    IMAGE_MODE_STRETCH = 4 /* scale the image to the size of each screen */
+} image_mode_t;
+
+void load_builtin_indicator(void);
+void load_indicator_svg(const char *path);
+void parse_indicator_svg(void);
 xcb_pixmap_t draw_image(uint32_t* resolution);
+void free_bg_pixmap(void);
+void invalidate_render_context(void);
 void redraw_screen(void);
+void queue_redraw(void);
+void process_queued_redraw(void);
+bool redraw_is_queued(void);
+void note_user_input(void);
+void select_animation_frame(void);
 void clear_indicator(void);
 
 #endif
@@ -11,6 +11,8 @@
 #include <xcb/xcb_image.h>
 #include <xcb/xcb_atom.h>
 #include <xcb/xcb_aux.h>
+#include <xcb/shm.h>
+#include <xcb/dpms.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -18,12 +20,45 @@
 #include <unistd.h>
 #include <assert.h>
 #include <err.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
 
+#include "i3lock.h"
 #include "cursors.h"
 
 xcb_connection_t *conn;
 xcb_screen_t *screen;
 
+extern bool debug_mode;
+
+/* How long grab_pointer_and_keyboard() keeps trying, in milliseconds. */
+#define GRAB_DEADLINE_MS 3000
+
+/* The delay between two tries to grab starts at GRAB_MIN_DELAY_MS and
+ * doubles with every failed try, up to GRAB_MAX_DELAY_MS. */
+#define GRAB_MIN_DELAY_MS 1
+#define GRAB_MAX_DELAY_MS 100
+
+/* Shared memory segment used by shm_put_image(). */
+static xcb_shm_seg_t shm_seg = XCB_NONE;
+static uint8_t *shm_data = NULL;
+static size_t shm_size = 0;
+/* Set once we know MIT-SHM cannot be used, e.g. on remote X11 servers. */
+static bool shm_unavailable = false;
+/* Round trip issued after the last ShmPutImage, the segment must not be
+ * overwritten before the server has processed it. */
+static bool shm_busy = false;
+static xcb_get_input_focus_cookie_t shm_fence;
+
+/* Bytes uploaded via ShmPutImage, which bypasses the X11 socket. Reported by
+ * --benchmark-redraw. */
+unsigned long long shm_bytes_uploaded = 0;
+
+/* The cursor the pointer was grabbed with, see set_pointer_wakeup(). */
+static xcb_cursor_t grab_cursor = XCB_NONE;
+
 #define curs_invisible_width 8
 #define curs_invisible_height 8
 
@@ -81,6 +116,235 @@ xcb_visualtype_t *get_root_visual_type(xcb_screen_t *screen) {
     return NULL;
 }
 
+/*
+ * Returns a visual with the given depth (e.g. 32 for ARGB), or NULL if the
+ * screen has none.
+ *
+ */
+xcb_visualtype_t *get_visual_type_for_depth(xcb_screen_t *screen, uint8_t depth) {
+    xcb_depth_iterator_t depth_iter;
+    xcb_visualtype_iterator_t visual_iter;
+
+    for (depth_iter = xcb_screen_allowed_depths_iterator(screen);
+         depth_iter.rem;
+         xcb_depth_next(&depth_iter)) {
+        if (depth_iter.data->depth != depth)
+            continue;
+
+        visual_iter = xcb_depth_visuals_iterator(depth_iter.data);
+        if (visual_iter.rem)
+            return visual_iter.data;
+    }
+
+    return NULL;
+}
+
+/*
+ * Frees the shared memory segment, if any.
+ *
+ */
+static void shm_free(xcb_connection_t *conn) {
+    if (shm_seg != XCB_NONE) {
+        xcb_shm_detach(conn, shm_seg);
+        shm_seg = XCB_NONE;
+    }
+    if (shm_data != NULL) {
+        shmdt(shm_data);
+        shm_data = NULL;
+    }
+    shm_size = 0;
+}
+
+/*
+ * Creates a shared memory segment of the given size and attaches it to the
+ * X11 server. With read_only, the server can only read from it (ShmPutImage),
+ * otherwise it can also write to it (ShmGetImage). Returns false if that
+ * fails, e.g. because the X11 server runs on another machine.
+ *
+ */
+static bool shm_attach(xcb_connection_t *conn, size_t size, bool read_only,
+                       xcb_shm_seg_t *seg, uint8_t **data) {
+    int shmid = shmget(IPC_PRIVATE, size, IPC_CREAT | 0600);
+    if (shmid == -1)
+        return false;
+    void *addr = shmat(shmid, NULL, 0);
+    if (addr == (void *)-1) {
+        shmctl(shmid, IPC_RMID, NULL);
+        return false;
+    }
+
+    /* Attaching fails when the X11 server runs on another machine. */
+    *seg = xcb_generate_id(conn);
+    xcb_generic_error_t *error = xcb_request_check(conn, xcb_shm_attach_checked(conn, *seg, shmid, read_only));
+    /* The segment is destroyed once both we and the server detach it. */
+    shmctl(shmid, IPC_RMID, NULL);
+    if (error != NULL) {
+        DEBUG("Could not attach MIT-SHM segment (error_code = %d)\n", error->error_code);
+        free(error);
+        *seg = XCB_NONE;
+        shmdt(addr);
+        return false;
+    }
+
+    *data = addr;
+    return true;
+}
+
+/*
+ * Makes sure the shared memory segment is at least size bytes large and
+ * attached to the X11 server. Returns false if MIT-SHM cannot be used.
+ *
+ */
+static bool shm_reserve(xcb_connection_t *conn, size_t size) {
+    if (shm_unavailable)
+        return false;
+
+    if (shm_data != NULL && shm_size >= size)
+        return true;
+
+    if (shm_data == NULL) {
+        const xcb_query_extension_reply_t *extreply = xcb_get_extension_data(conn, &xcb_shm_id);
+        if (!extreply || !extreply->present) {
+            DEBUG("MIT-SHM extension not found, uploading images via the X11 socket.\n");
+            shm_unavailable = true;
+            return false;
+        }
+    }
+
+    shm_free(conn);
+
+    if (!shm_attach(conn, size, true, &shm_seg, &shm_data)) {
+        DEBUG("Uploading images via the X11 socket.\n");
+        shm_unavailable = true;
+        return false;
+    }
+    shm_size = size;
+    return true;
+}
+
+/*
+ * Uploads the given image data (in ZPixmap format with 4 bytes per pixel,
+ * like cairo’s ARGB32/RGB24 formats) to the drawable via MIT-SHM, without
+ * sending the pixels through the X11 socket. Returns false if MIT-SHM is not
+ * available, in which case the caller needs to upload the image differently.
+ *
+ */
+static bool shm_put_image(xcb_connection_t *conn, xcb_drawable_t drawable, xcb_gcontext_t gc,
+                          uint16_t width, uint16_t height, uint8_t depth,
+                          const uint8_t *data, int stride) {
+    size_t row_size = width * 4;
+    if (!shm_reserve(conn, row_size * height))
+        return false;
+
+    /* Wait until the server is done reading the previous image. Usually the
+     * reply arrived long ago. */
+    if (shm_busy) {
+        free(xcb_get_input_focus_reply(conn, shm_fence, NULL));
+        shm_busy = false;
+    }
+
+    if (stride == row_size) {
+        memcpy(shm_data, data, row_size * height);
+    } else {
+        for (int row = 0; row < height; row++)
+            memcpy(shm_data + row * row_size, data + row * stride, row_size);
+    }
+
+    xcb_shm_put_image(conn, drawable, gc,
+                      width, height, /* total size of the image in the segment */
+                      0, 0, width, height, /* source rectangle */
+                      0, 0, depth, XCB_IMAGE_FORMAT_Z_PIXMAP,
+                      false, /* no completion event, see shm_fence */
+                      shm_seg, 0);
+    shm_bytes_uploaded += row_size * height;
+    shm_fence = xcb_get_input_focus(conn);
+    shm_busy = true;
+    return true;
+}
+
+/*
+ * Uploads the given image data (in ZPixmap format with 4 bytes per pixel) to
+ * the drawable. MIT-SHM is used if possible, otherwise the image is sent
+ * through the X11 socket, split into as many PutImage requests as necessary.
+ *
+ */
+void upload_image(xcb_connection_t *conn, xcb_drawable_t drawable, xcb_gcontext_t gc,
+                  uint16_t width, uint16_t height, uint8_t depth,
+                  const uint8_t *data, int stride) {
+    if (shm_put_image(conn, drawable, gc, width, height, depth, data, stride))
+        return;
+
+    /* The maximum request length is given in units of 4 bytes. 24 bytes are
+     * needed for the PutImage request itself. */
+    const size_t row_size = width * 4;
+    const size_t max_size = xcb_get_maximum_request_length(conn) * 4 - 24;
+    int rows_per_request = (max_size / row_size > 0 ? max_size / row_size : 1);
+    if (stride != row_size)
+        rows_per_request = 1;
+
+    for (int row = 0; row < height; row += rows_per_request) {
+        int rows = (height - row < rows_per_request ? height - row : rows_per_request);
+        xcb_put_image(conn, XCB_IMAGE_FORMAT_Z_PIXMAP, drawable, gc,
+                      width, rows, 0, row, 0, depth,
+                      row_size * rows, data + row * stride);
+    }
+}
+
+/*
+ * Downloads the given area of the drawable (in ZPixmap format with 4 bytes
+ * per pixel) into data. MIT-SHM is used if possible, otherwise the image is
+ * sent through the X11 socket. Returns false if the image could not be
+ * fetched.
+ *
+ * This is only used for the screenshot (--blur, --pixelate), which spans the
+ * whole root window. It gets its own (writable) shared memory segment, which
+ * is freed right away, instead of growing the one for the small indicator
+ * uploads to that size.
+ *
+ */
+bool download_image(xcb_connection_t *conn, xcb_drawable_t drawable,
+                    uint16_t width, uint16_t height, uint8_t *data, int stride) {
+    const size_t row_size = width * 4;
+    const uint8_t *pixels = NULL;
+    xcb_get_image_reply_t *reply = NULL;
+    xcb_shm_seg_t seg = XCB_NONE;
+    uint8_t *seg_data = NULL;
+
+    const xcb_query_extension_reply_t *extreply = xcb_get_extension_data(conn, &xcb_shm_id);
+    if (!shm_unavailable && extreply && extreply->present &&
+        shm_attach(conn, row_size * height, false, &seg, &seg_data)) {
+        xcb_shm_get_image_reply_t *shm_reply = xcb_shm_get_image_reply(
+            conn,
+            xcb_shm_get_image(conn, drawable, 0, 0, width, height, ~0,
+                              XCB_IMAGE_FORMAT_Z_PIXMAP, seg, 0),
+            NULL);
+        if (shm_reply != NULL) {
+            pixels = seg_data;
+            free(shm_reply);
+        }
+    }
+
+    if (pixels == NULL) {
+        reply = xcb_get_image_reply(
+            conn,
+            xcb_get_image(conn, XCB_IMAGE_FORMAT_Z_PIXMAP, drawable, 0, 0, width, height, ~0),
+            NULL);
+        if (reply != NULL && xcb_get_image_data_length(reply) >= row_size * height)
+            pixels = xcb_get_image_data(reply);
+    }
+
+    if (pixels != NULL) {
+        for (int row = 0; row < height; row++)
+            memcpy(data + row * stride, pixels + row * row_size, row_size);
+    }
+    if (seg != XCB_NONE) {
+        xcb_shm_detach(conn, seg);
+        shmdt(seg_data);
+    }
+    free(reply);
+    return (pixels != NULL);
+}
+
 xcb_pixmap_t create_bg_pixmap(xcb_connection_t *conn, xcb_screen_t *scr, u_int32_t *resolution, char *color) {
     xcb_pixmap_t bg_pixmap = xcb_generate_id(conn);
     xcb_create_pixmap(conn, scr->root_depth, bg_pixmap, scr->root,
@@ -151,14 +415,30 @@ xcb_window_t open_fullscreen_window(xcb_connection_t *conn, xcb_screen_t *scr, c
     values[0] = XCB_STACK_MODE_ABOVE;
     xcb_configure_window(conn, win, XCB_CONFIG_WINDOW_STACK_MODE, values);
 
-    /* Ensure that the window is created and set up before returning */
-    xcb_aux_sync(conn);
+    /* No need to wait for the window to be set up: the grab requests which
+     * follow are processed after these requests, and waiting for their
+     * replies thus also waits for the window. */
+    xcb_flush(conn);
 
     return win;
 }
 
 /*
- * Repeatedly tries to grab pointer and keyboard (up to 1000 times).
+ * Returns the milliseconds elapsed since the given CLOCK_MONOTONIC time.
+ *
+ */
+static long ms_since(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/*
+ * Repeatedly tries to grab pointer and keyboard, for up to GRAB_DEADLINE_MS.
+ * Both grabs are requested at once, so that each try only takes one round
+ * trip. Between tries, we back off exponentially, but wake up early when the
+ * X server sends something: another client releasing its grab usually
+ * causes focus events.
  *
  */
 void grab_pointer_and_keyboard(xcb_connection_t *conn, xcb_screen_t *screen, xcb_cursor_t cursor) {
@@ -168,53 +448,107 @@ void grab_pointer_and_keyboard(xcb_connection_t *conn, xcb_screen_t *screen, xcb
     xcb_grab_keyboard_cookie_t kcookie;
     xcb_grab_keyboard_reply_t *kreply;
 
-    int tries = 10000;
-
-    while (tries-- > 0) {
-        pcookie = xcb_grab_pointer(
-            conn,
-            false,               /* get all pointer events specified by the following mask */
-            screen->root,        /* grab the root window */
-            XCB_NONE,            /* which events to let through */
-            XCB_GRAB_MODE_ASYNC, /* pointer events should continue as normal */
-            XCB_GRAB_MODE_ASYNC, /* keyboard mode */
-            XCB_NONE,            /* confine_to = in which window should the cursor stay */
-            cursor,              /* we change the cursor to whatever the user wanted */
-            XCB_CURRENT_TIME);
-
-        if ((preply = xcb_grab_pointer_reply(conn, pcookie, NULL)) &&
-            preply->status == XCB_GRAB_STATUS_SUCCESS) {
+    bool pointer_grabbed = false;
+    bool keyboard_grabbed = false;
+    int tries = 0;
+    grab_cursor = cursor;
+    int delay_ms = GRAB_MIN_DELAY_MS;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    /* Focus events are ignored by the event loop, we only want them for
+     * waking up. The event mask is restored below. */
+    xcb_change_window_attributes(conn, screen->root, XCB_CW_EVENT_MASK,
+                                 (uint32_t[]){XCB_EVENT_MASK_STRUCTURE_NOTIFY | XCB_EVENT_MASK_FOCUS_CHANGE});
+
+    while (true) {
+        tries++;
+        if (!pointer_grabbed)
+            pcookie = xcb_grab_pointer(
+                conn,
+                false,               /* get all pointer events specified by the following mask */
+                screen->root,        /* grab the root window */
+                XCB_NONE,            /* which events to let through */
+                XCB_GRAB_MODE_ASYNC, /* pointer events should continue as normal */
+                XCB_GRAB_MODE_ASYNC, /* keyboard mode */
+                XCB_NONE,            /* confine_to = in which window should the cursor stay */
+                cursor,              /* we change the cursor to whatever the user wanted */
+                XCB_CURRENT_TIME);
+
+        if (!keyboard_grabbed)
+            kcookie = xcb_grab_keyboard(
+                conn,
+                true,         /* report events */
+                screen->root, /* grab the root window */
+                XCB_CURRENT_TIME,
+                XCB_GRAB_MODE_ASYNC, /* process events as normal, do not require sync */
+                XCB_GRAB_MODE_ASYNC);
+
+        if (!pointer_grabbed &&
+            (preply = xcb_grab_pointer_reply(conn, pcookie, NULL))) {
+            pointer_grabbed = (preply->status == XCB_GRAB_STATUS_SUCCESS);
             free(preply);
-            break;
         }
 
-        /* Make this quite a bit slower */
-        usleep(50);
-    }
-
-    while (tries-- > 0) {
-        kcookie = xcb_grab_keyboard(
-            conn,
-            true,         /* report events */
-            screen->root, /* grab the root window */
-            XCB_CURRENT_TIME,
-            XCB_GRAB_MODE_ASYNC, /* process events as normal, do not require sync */
-            XCB_GRAB_MODE_ASYNC);
-
-        if ((kreply = xcb_grab_keyboard_reply(conn, kcookie, NULL)) &&
-            kreply->status == XCB_GRAB_STATUS_SUCCESS) {
+        if (!keyboard_grabbed &&
+            (kreply = xcb_grab_keyboard_reply(conn, kcookie, NULL))) {
+            keyboard_grabbed = (kreply->status == XCB_GRAB_STATUS_SUCCESS);
             free(kreply);
-            break;
         }
 
-        /* Make this quite a bit slower */
-        usleep(50);
+        if (pointer_grabbed && keyboard_grabbed)
+            break;
+
+        long elapsed = ms_since(&start);
+        if (elapsed >= GRAB_DEADLINE_MS || xcb_connection_has_error(conn))
+            break;
+
+        /* Wait for the delay to pass or for the X server to send something,
+         * whichever comes first. */
+        struct pollfd pfd = {xcb_get_file_descriptor(conn), POLLIN, 0};
+        int timeout = (delay_ms < GRAB_DEADLINE_MS - elapsed ? delay_ms : GRAB_DEADLINE_MS - elapsed);
+        poll(&pfd, 1, timeout);
+        delay_ms = (delay_ms * 2 < GRAB_MAX_DELAY_MS ? delay_ms * 2 : GRAB_MAX_DELAY_MS);
     }
 
-    if (tries <= 0)
+    xcb_change_window_attributes(conn, screen->root, XCB_CW_EVENT_MASK,
+                                 (uint32_t[]){XCB_EVENT_MASK_STRUCTURE_NOTIFY});
+
+    DEBUG("grab took %d tries and %ld ms\n", tries, ms_since(&start));
+
+    if (!pointer_grabbed || !keyboard_grabbed)
         errx(EXIT_FAILURE, "Cannot grab pointer/keyboard");
 }
 
+/*
+ * Returns whether DPMS has put the monitors into standby, suspend or off
+ * mode. This takes a round trip.
+ *
+ */
+bool dpms_monitors_off(xcb_connection_t *conn) {
+    if (!xcb_get_extension_data(conn, &xcb_dpms_id)->present)
+        return false;
+
+    xcb_dpms_info_reply_t *reply = xcb_dpms_info_reply(conn, xcb_dpms_info(conn), NULL);
+    if (reply == NULL)
+        return false;
+
+    bool off = (reply->state && reply->power_level != XCB_DPMS_DPMS_MODE_ON);
+    free(reply);
+    return off;
+}
+
+/*
+ * Enables or disables pointer motion and button events on our pointer grab.
+ * Usually we do not need them, but DPMS does not tell when the monitors are
+ * woken up again, and moving the pointer is one way to do it.
+ *
+ */
+void set_pointer_wakeup(xcb_connection_t *conn, bool enable) {
+    uint16_t mask = (enable ? XCB_EVENT_MASK_POINTER_MOTION | XCB_EVENT_MASK_BUTTON_PRESS : XCB_NONE);
+    xcb_change_active_pointer_grab(conn, grab_cursor, XCB_CURRENT_TIME, mask);
+}
+
 xcb_cursor_t create_cursor(xcb_connection_t *conn, xcb_screen_t *screen, xcb_window_t win, int choice) {
     xcb_pixmap_t bitmap;
     xcb_pixmap_t mask;
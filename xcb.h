@@ -3,15 +3,24 @@
 
 #include <xcb/xcb.h>
 #include <xcb/dpms.h>
+#include <stdbool.h>
 
 extern xcb_connection_t *conn;
 extern xcb_screen_t *screen;
 
 xcb_visualtype_t *get_root_visual_type(xcb_screen_t *s);
+xcb_visualtype_t *get_visual_type_for_depth(xcb_screen_t *s, uint8_t depth);
+void upload_image(xcb_connection_t *conn, xcb_drawable_t drawable, xcb_gcontext_t gc,
+                  uint16_t width, uint16_t height, uint8_t depth,
+                  const uint8_t *data, int stride);
+bool download_image(xcb_connection_t *conn, xcb_drawable_t drawable,
+                    uint16_t width, uint16_t height, uint8_t *data, int stride);
 xcb_pixmap_t create_bg_pixmap(xcb_connection_t *conn, xcb_screen_t *scr, u_int32_t *resolution, char *color);
 xcb_window_t open_fullscreen_window(xcb_connection_t *conn, xcb_screen_t *scr, char *color, xcb_pixmap_t pixmap);
 void grab_pointer_and_keyboard(xcb_connection_t *conn, xcb_screen_t *screen, xcb_cursor_t cursor);
 void dpms_set_mode(xcb_connection_t *conn, xcb_dpms_dpms_mode_t mode);
+bool dpms_monitors_off(xcb_connection_t *conn);
+void set_pointer_wakeup(xcb_connection_t *conn, bool enable);
 xcb_cursor_t create_cursor(xcb_connection_t *conn, xcb_screen_t *screen, xcb_window_t win, int choice);
 
 #endif
@@ -9,6 +9,7 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
 #include <xcb/xcb.h>
 #include <xcb/xinerama.h>
@@ -23,9 +24,70 @@ int xr_screens = 0;
 /* The resolutions of the currently present Xinerama screens. */
 Rect *xr_resolutions;
 
+/* Number of screens xr_resolutions has room for. */
+static int xr_resolutions_size = 0;
+
 static bool xinerama_active;
 extern bool debug_mode;
 
+/*
+ * Stores the screens from the given QueryScreens reply in xr_resolutions,
+ * re-using the array. Returns whether any screen was added, removed, moved
+ * or resized.
+ *
+ */
+static bool handle_query_screens(xcb_xinerama_query_screens_cookie_t cookie) {
+    xcb_xinerama_query_screens_reply_t *reply;
+    xcb_xinerama_screen_info_t *screen_info;
+
+    reply = xcb_xinerama_query_screens_reply(conn, cookie, NULL);
+    if (!reply) {
+        if (debug_mode)
+            fprintf(stderr, "Couldn't get Xinerama screens\n");
+        return false;
+    }
+    screen_info = xcb_xinerama_query_screens_screen_info(reply);
+    int screens = xcb_xinerama_query_screens_screen_info_length(reply);
+
+    if (screens > xr_resolutions_size) {
+        Rect *resolutions = realloc(xr_resolutions, screens * sizeof(Rect));
+        /* No memory? Just keep on using the old information. */
+        if (!resolutions) {
+            free(reply);
+            return false;
+        }
+        xr_resolutions = resolutions;
+        xr_resolutions_size = screens;
+    }
+
+    bool changed = (screens != xr_screens);
+    for (int screen = 0; screen < screens; screen++) {
+        Rect rect = {
+            .x = screen_info[screen].x_org,
+            .y = screen_info[screen].y_org,
+            .width = screen_info[screen].width,
+            .height = screen_info[screen].height};
+        if (screen < xr_screens &&
+            memcmp(&xr_resolutions[screen], &rect, sizeof(Rect)) == 0)
+            continue;
+
+        changed = true;
+        xr_resolutions[screen] = rect;
+        DEBUG("found Xinerama screen: %d x %d at %d x %d\n",
+              screen_info[screen].width, screen_info[screen].height,
+              screen_info[screen].x_org, screen_info[screen].y_org);
+    }
+    xr_screens = screens;
+
+    free(reply);
+    return changed;
+}
+
+/*
+ * Checks whether Xinerama is active and queries the screens. Both requests
+ * are sent at once, so that this only takes a single round trip.
+ *
+ */
 void xinerama_init(void) {
     if (!xcb_get_extension_data(conn, &xcb_xinerama_id)->present) {
         DEBUG("Xinerama extension not found, disabling.\n");
@@ -34,57 +96,31 @@ void xinerama_init(void) {
 
     xcb_xinerama_is_active_cookie_t cookie;
     xcb_xinerama_is_active_reply_t *reply;
+    xcb_xinerama_query_screens_cookie_t screens_cookie;
 
     cookie = xcb_xinerama_is_active(conn);
+    screens_cookie = xcb_xinerama_query_screens_unchecked(conn);
     reply = xcb_xinerama_is_active_reply(conn, cookie, NULL);
-    if (!reply)
-        return;
-
-    if (!reply->state) {
+    if (!reply || !reply->state) {
         free(reply);
+        xcb_discard_reply(conn, screens_cookie.sequence);
         return;
     }
 
     xinerama_active = true;
     free(reply);
+
+    handle_query_screens(screens_cookie);
 }
 
-void xinerama_query_screens(void) {
+/*
+ * Queries the screens again, e.g. after the screen configuration changed.
+ * Returns whether any screen changed.
+ *
+ */
+bool xinerama_query_screens(void) {
     if (!xinerama_active)
-        return;
-
-    xcb_xinerama_query_screens_cookie_t cookie;
-    xcb_xinerama_query_screens_reply_t *reply;
-    xcb_xinerama_screen_info_t *screen_info;
-
-    cookie = xcb_xinerama_query_screens_unchecked(conn);
-    reply = xcb_xinerama_query_screens_reply(conn, cookie, NULL);
-    if (!reply) {
-        if (debug_mode)
-            fprintf(stderr, "Couldn't get Xinerama screens\n");
-        return;
-    }
-    screen_info = xcb_xinerama_query_screens_screen_info(reply);
-    int screens = xcb_xinerama_query_screens_screen_info_length(reply);
+        return false;
 
-    Rect *resolutions = malloc(screens * sizeof(Rect));
-    /* No memory? Just keep on using the old information. */
-    if (!resolutions) {
-        free(reply);
-        return;
-    }
-    xr_resolutions = resolutions;
-    xr_screens = screens;
-
-    for (int screen = 0; screen < xr_screens; screen++) {
-        xr_resolutions[screen].x = screen_info[screen].x_org;
-        xr_resolutions[screen].y = screen_info[screen].y_org;
-        xr_resolutions[screen].width = screen_info[screen].width;
-        xr_resolutions[screen].height = screen_info[screen].height;
-        DEBUG("found Xinerama screen: %d x %d at %d x %d\n",
-              screen_info[screen].width, screen_info[screen].height,
-              screen_info[screen].x_org, screen_info[screen].y_org);
-    }
-
-    free(reply);
+    return handle_query_screens(xcb_xinerama_query_screens_unchecked(conn));
 }
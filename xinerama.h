@@ -12,6 +12,6 @@ extern int xr_screens;
 extern Rect *xr_resolutions;
 
 void xinerama_init(void);
-void xinerama_query_screens(void);
+bool xinerama_query_screens(void);
 
 #endif